@@ -37,6 +37,7 @@
 #include "include/libplacebo/dispatch.h"
 #include "include/libplacebo/filters.h"
 #include "include/libplacebo/ra.h"
+#include "include/libplacebo/ra_null.h"
 #include "include/libplacebo/shaders.h"
 #include "include/libplacebo/shaders/colorspace.h"
 #include "include/libplacebo/shaders/sampling.h"
@@ -88,3 +89,16 @@ static inline float *pl_transpose(int dim, float *out, const float *in)
 #define PL_MIN(x, y) ((x) < (y) ? (x) : (y))
 #define PL_CMP(a, b) ((a) < (b) ? -1 : (a) > (b) ? 1 : 0)
 #define PL_DEF(x, d) ((x) ? (x) : (d))
+
+// Combines `hash` into the running hash `*accum`. Unlike a plain XOR, the
+// result depends on the order in which the hashes were merged. The final
+// mixing step makes sure every input bit affects all output bits, since the
+// low bits are used directly for hash table lookups
+static inline void pl_hash_merge(uint64_t *accum, uint64_t hash)
+{
+    uint64_t x = *accum * UINT64_C(0x9e3779b97f4a7c15) + hash;
+    x ^= x >> 31;
+    x *= UINT64_C(0xbf58476d1ce4e5b9);
+    x ^= x >> 29;
+    *accum = x;
+}
@@ -21,6 +21,8 @@
 
 #include "common.h"
 #include "context.h"
+#include "shaders.h"
+#include "thread_pool.h"
 
 static pthread_mutex_t pl_ctx_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int pl_ctx_refcount;
@@ -74,6 +76,17 @@ struct pl_context *pl_context_create(int api_ver,
 
     struct pl_context *ctx = talloc_zero(NULL, struct pl_context);
     ctx->params = *PL_DEF(params, &pl_context_default_params);
+    pthread_mutex_init(&ctx->log_lock, NULL);
+    ctx->lut_cache = sh_lut_cache_create(ctx);
+
+    if (ctx->params.filter_threads > 0) {
+        ctx->filter_pool = pl_thread_pool_create(ctx, ctx->params.filter_threads);
+        if (!ctx->filter_pool) {
+            pl_msg(ctx, PL_LOG_WARN, "Failed creating filter threads, "
+                   "falling back to serial LUT generation");
+        }
+    }
+
     return ctx;
 }
 
@@ -81,6 +94,11 @@ const struct pl_context_params pl_context_default_params = {0};
 
 void pl_context_destroy(struct pl_context **ctx)
 {
+    if (*ctx) {
+        pl_thread_pool_destroy(&(*ctx)->filter_pool);
+        sh_lut_cache_destroy(&(*ctx)->lut_cache);
+        pthread_mutex_destroy(&(*ctx)->log_lock);
+    }
     TA_FREEP(ctx);
 
     // Do global uninitialization only when refcount reaches 0
@@ -139,9 +157,29 @@ void pl_msg_va(struct pl_context *ctx, enum pl_log_level lev, const char *fmt,
     if (!pl_msg_test(ctx, lev))
         return;
 
-    ctx->logbuffer.len = 0;
-    bstr_xappend_vasprintf(ctx, &ctx->logbuffer, fmt, va);
-    ctx->params.log_cb(ctx->params.log_priv, lev, ctx->logbuffer.start);
+    // Messages may be logged from several threads at once, so format them
+    // into a local buffer first, and only serialize the calls to `log_cb`
+    char buf[1024];
+    char *msg = buf;
+    va_list copy;
+    va_copy(copy, va);
+    int len = vsnprintf_c(buf, sizeof(buf), fmt, copy);
+    va_end(copy);
+    if (len < 0)
+        return;
+    if ((size_t) len >= sizeof(buf)) {
+        msg = malloc(len + 1);
+        if (!msg)
+            return;
+        vsnprintf_c(msg, len + 1, fmt, va);
+    }
+
+    pthread_mutex_lock(&ctx->log_lock);
+    ctx->params.log_cb(ctx->params.log_priv, lev, msg);
+    pthread_mutex_unlock(&ctx->log_lock);
+
+    if (msg != buf)
+        free(msg);
 }
 
 void pl_msg_source(struct pl_context *ctx, enum pl_log_level lev, const char *src)
@@ -18,13 +18,16 @@
 #pragma once
 
 #include <stdarg.h>
+#include <pthread.h>
 #include "bstr/bstr.h"
 
 #include "common.h"
 
 struct pl_context {
     struct pl_context_params params;
-    struct bstr logbuffer;
+    pthread_mutex_t log_lock; // serializes calls to `log_cb`
+    struct sh_lut_cache *lut_cache; // shared by all shaders, see sh_lut_filter
+    struct pl_thread_pool *filter_pool; // may be NULL, see pl_filter_generate
 };
 
 // Logging-related functions
@@ -15,10 +15,14 @@
  * License along with libplacebo. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <pthread.h>
+#include <time.h>
+
 #include "common.h"
 #include "context.h"
 #include "shaders.h"
 #include "ra.h"
+#include "thread_pool.h"
 
 enum {
     TMP_PRELUDE,   // GLSL version, global definitions, etc.
@@ -28,10 +32,28 @@ enum {
     TMP_COUNT,
 };
 
+// Open-addressing hash table (with linear probing) indexing passes by one of
+// their hashes. The size is always either 0 or a power of two, and the table
+// is kept at most half full to keep the probe sequences short. Several passes
+// may share the same key, unless the key is unique by construction.
+struct pass_table {
+    struct pass **slots;
+    int size;
+    int num;
+    bool by_program; // keyed by `program_hash` instead of `signature`
+};
+
 struct pl_dispatch {
     struct pl_context *ctx;
     const struct ra *ra;
+    struct pl_dispatch_params params;
     int current_ident;
+    uint64_t current_frame; // incremented by pl_dispatch_reset_frame
+    bool in_batch;          // whether we're inside ra_batch_begin
+
+    // the currently deferred shader, if `params.fuse_passes` is enabled
+    struct sh_deferred deferred;
+    uint64_t deferred_id;
 
     // pool of pl_shaders, in order to avoid frequent re-allocations
     struct pl_shader **shaders;
@@ -41,8 +63,44 @@ struct pl_dispatch {
     struct pass **passes;
     int num_passes;
 
+    // indexes of `passes` by their signature, and by their program_hash
+    // (only for passes which have one, see `pass.program_hash`)
+    struct pass_table by_signature;
+    struct pass_table by_program;
+
+    // estimated total size of all cached passes, see `pass.size`
+    size_t cache_size;
+
+    // compiled programs loaded by pl_dispatch_load, for passes that have not
+    // been created yet
+    struct cached_program *programs;
+    int num_programs;
+
     // temporary buffers to help avoid re_allocations during pass creation
     struct bstr tmp[TMP_COUNT];
+
+    // shared by all shaders, if structural keys are enabled
+    struct sh_text_cache *text_cache;
+
+    // for asynchronous pass compilation, if enabled
+    struct pl_thread_pool *pool;
+    pthread_mutex_t lock;     // protects `compile_job.done/result`, `stats`
+    pthread_cond_t job_done;  // signalled whenever a compile job completes
+    struct pl_dispatch_compile_stats stats;
+};
+
+// State of a pass which is being compiled by a worker thread. This owns a
+// deep copy of the pass parameters, since the original ones are temporary
+struct compile_job {
+    struct pl_dispatch *dp;
+    struct ra_pass_params params;
+    const struct ra_pass *result;
+    bool done;
+};
+
+struct cached_program {
+    uint64_t signature;
+    struct bstr data;
 };
 
 enum pass_var_type {
@@ -63,12 +121,33 @@ struct pass {
     uint64_t signature; // as returned by pl_shader_signature
     const struct ra_pass *pass;
     bool failed;
+    struct compile_job *job; // non-NULL while the pass is still compiling
+
+    // for cache eviction
+    uint64_t last_used; // value of `current_frame` when last dispatched
+    size_t size;        // estimated memory footprint of this pass
+
+    // hash of the generated GLSL, if the pass uses specialization constants.
+    // Passes with the same program_hash can share their compiled program
+    uint64_t program_hash;
+
+    // for pl_dispatch_stats
+    uint64_t shader_sig; // signature of the shader before translation
+    struct ra_timer *timer;
+    struct pl_dispatch_timing cpu, gpu;
 
     // contains cached data and update metadata, same order as pl_shader
     struct pass_var *vars;
 
-    // for uniform buffer updates
-    const struct ra_buf *ubo;
+    // for uniform buffer updates. Variable updates are staged in `ubo_data`
+    // and copied into a fresh buffer from `ubo_pool` whenever they change,
+    // so buffers which may still be in use by the GPU are never written to
+    struct ra_buf_pool ubo_pool;
+    struct ra_buf_params ubo_params;
+    const struct ra_buf *ubo; // currently bound buffer
+    void *ubo_data;
+    int ubo_index;
+    bool ubo_dirty;
     struct ra_desc ubo_desc; // temporary
 
     // Cached ra_pass_run_params. This will also contain mutable allocations
@@ -77,22 +156,234 @@ struct pass {
     struct ra_pass_run_params run_params;
 };
 
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void run_compile_job(void *priv)
+{
+    struct compile_job *job = priv;
+    struct pl_dispatch *dp = job->dp;
+
+    uint64_t start = time_ns();
+    const struct ra_pass *pass = ra_pass_create(dp->ra, &job->params);
+    uint64_t duration = time_ns() - start;
+
+    pthread_mutex_lock(&dp->lock);
+    job->result = pass;
+    job->done = true;
+    dp->stats.compile_ns += duration;
+    pthread_cond_broadcast(&dp->job_done);
+    pthread_mutex_unlock(&dp->lock);
+}
+
+// Installs the result of the pass's compile job, if it has completed. If
+// `wait` is true, blocks until this is the case. Returns whether the pass is
+// ready for use (which includes passes that failed compiling).
+static bool pass_poll_job(struct pl_dispatch *dp, struct pass *pass, bool wait)
+{
+    struct compile_job *job = pass->job;
+    if (!job)
+        return true;
+
+    pthread_mutex_lock(&dp->lock);
+    if (wait && !job->done) {
+        uint64_t start = time_ns();
+        while (!job->done)
+            pthread_cond_wait(&dp->job_done, &dp->lock);
+        dp->stats.stall_ns += time_ns() - start;
+    }
+    bool done = job->done;
+    pthread_mutex_unlock(&dp->lock);
+
+    if (!done)
+        return false;
+
+    pass->pass = pass->run_params.pass = job->result;
+    pass->failed = !pass->pass;
+    if (pass->failed)
+        PL_ERR(dp, "Failed creating render pass for dispatch");
+
+    size_t prog_len = pass->pass ? pass->pass->params.cached_program_len : 0;
+    pass->size += prog_len;
+    dp->cache_size += prog_len;
+    dp->stats.num_pending--;
+
+    talloc_free(job);
+    pass->job = NULL;
+    return true;
+}
+
 static void pass_destroy(struct pl_dispatch *dp, struct pass *pass)
 {
     if (!pass)
         return;
 
-    ra_buf_destroy(dp->ra, &pass->ubo);
+    // Passes can't be destroyed while they're still being compiled
+    pass_poll_job(dp, pass, true);
+
+    ra_buf_pool_uninit(dp->ra, &pass->ubo_pool);
+    ra_timer_destroy(dp->ra, &pass->timer);
     ra_pass_destroy(dp->ra, &pass->pass);
     talloc_free(pass);
 }
 
-struct pl_dispatch *pl_dispatch_create(struct pl_context *ctx, const struct ra *ra)
+static inline uint64_t pass_key(const struct pass_table *t,
+                                const struct pass *pass)
+{
+    return t->by_program ? pass->program_hash : pass->signature;
+}
+
+// Returns a pass with the given key, or NULL if there is none. If `compiled`
+// is true, only passes which were successfully compiled are considered.
+static struct pass *pass_table_lookup(const struct pass_table *t, uint64_t key,
+                                      bool compiled)
+{
+    if (!t->size)
+        return NULL;
+
+    // The keys are already uniformly distributed hashes, so the low bits can
+    // be used as the starting slot directly
+    size_t mask = t->size - 1;
+    for (size_t i = key & mask;; i = (i + 1) & mask) {
+        struct pass *pass = t->slots[i];
+        if (!pass)
+            return NULL;
+        if (pass_key(t, pass) == key && (!compiled || pass->pass))
+            return pass;
+    }
+}
+
+static void pass_table_place(struct pass_table *t, struct pass *pass)
+{
+    size_t mask = t->size - 1;
+    size_t i = pass_key(t, pass) & mask;
+    while (t->slots[i])
+        i = (i + 1) & mask;
+    t->slots[i] = pass;
+}
+
+static void pass_table_insert(void *tactx, struct pass_table *t,
+                              struct pass *pass)
+{
+    if (2 * (t->num + 1) > t->size) {
+        // Grow the table and re-insert all existing passes
+        struct pass **old = t->slots;
+        int old_size = t->size;
+        t->size = PL_MAX(old_size * 2, 16);
+        t->slots = talloc_zero_array(tactx, struct pass *, t->size);
+        for (int i = 0; i < old_size; i++) {
+            if (old[i])
+                pass_table_place(t, old[i]);
+        }
+        talloc_free(old);
+    }
+
+    pass_table_place(t, pass);
+    t->num++;
+}
+
+static void pass_table_remove(struct pass_table *t, const struct pass *pass)
+{
+    size_t mask = t->size - 1;
+    size_t i = pass_key(t, pass) & mask;
+    while (t->slots[i] != pass)
+        i = (i + 1) & mask;
+
+    // Move back any entries in the same probe sequence which would otherwise
+    // become unreachable, i.e. whose home slot does not lie in (i, j]
+    for (size_t j = (i + 1) & mask; t->slots[j]; j = (j + 1) & mask) {
+        size_t home = pass_key(t, t->slots[j]) & mask;
+        bool reachable = i <= j ? (i < home && home <= j)
+                                : (i < home || home <= j);
+        if (!reachable) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+
+    t->slots[i] = NULL;
+    t->num--;
+}
+
+static bool cache_exceeded(const struct pl_dispatch *dp)
+{
+    const struct pl_dispatch_params *params = &dp->params;
+    if (params->max_passes && dp->num_passes > params->max_passes)
+        return true;
+    if (params->max_cache_size && dp->cache_size > params->max_cache_size)
+        return true;
+    return false;
+}
+
+static int cmp_last_used(const void *pa, const void *pb)
+{
+    const struct pass *a = *(const struct pass **) pa;
+    const struct pass *b = *(const struct pass **) pb;
+    return PL_CMP(a->last_used, b->last_used);
+}
+
+// Evicts the least recently used passes until the cache is back within the
+// configured limits. Passes used during the current frame are never evicted.
+static void evict_passes(struct pl_dispatch *dp)
+{
+    if (!cache_exceeded(dp))
+        return;
+
+    // Sort the list of passes by age, with the oldest passes first. The order
+    // of `dp->passes` is otherwise irrelevant
+    qsort(dp->passes, dp->num_passes, sizeof(struct pass *), cmp_last_used);
+
+    int num_evicted = 0;
+    while (num_evicted < dp->num_passes && cache_exceeded(dp)) {
+        struct pass *pass = dp->passes[num_evicted];
+        if (pass->last_used >= dp->current_frame)
+            break;
+
+        pass_table_remove(&dp->by_signature, pass);
+        if (pass->program_hash)
+            pass_table_remove(&dp->by_program, pass);
+        dp->cache_size -= pass->size;
+        dp->num_passes--;
+        pass_destroy(dp, pass);
+        num_evicted++;
+    }
+
+    if (!num_evicted)
+        return;
+
+    PL_DEBUG(dp, "Evicted %d passes from the dispatch cache", num_evicted);
+    memmove(&dp->passes[0], &dp->passes[num_evicted],
+            dp->num_passes * sizeof(struct pass *));
+}
+
+const struct pl_dispatch_params pl_dispatch_default_params = {0};
+
+struct pl_dispatch *pl_dispatch_create(struct pl_context *ctx, const struct ra *ra,
+                                       const struct pl_dispatch_params *params)
 {
     assert(ctx);
     struct pl_dispatch *dp = talloc_zero(ctx, struct pl_dispatch);
     dp->ctx = ctx;
     dp->ra = ra;
+    dp->params = *PL_DEF(params, &pl_dispatch_default_params);
+    pthread_mutex_init(&dp->lock, NULL);
+    pthread_cond_init(&dp->job_done, NULL);
+    dp->by_program.by_program = true;
+
+    if (dp->params.structural_keys)
+        dp->text_cache = sh_text_cache_create(dp);
+
+    if (dp->params.compile_threads > 0) {
+        dp->pool = pl_thread_pool_create(dp, dp->params.compile_threads);
+        if (!dp->pool) {
+            PL_WARN(dp, "Failed creating compiler threads, falling back to "
+                    "synchronous pass compilation");
+        }
+    }
 
     return dp;
 }
@@ -103,11 +394,20 @@ void pl_dispatch_destroy(struct pl_dispatch **ptr)
     if (!dp)
         return;
 
+    // Wait for all outstanding compile jobs to finish first
+    pl_thread_pool_destroy(&dp->pool);
+    pl_dispatch_flush(dp);
+
+    if (dp->in_batch)
+        ra_batch_end(dp->ra);
+
     for (int i = 0; i < dp->num_passes; i++)
         pass_destroy(dp, dp->passes[i]);
     for (int i = 0; i < dp->num_shaders; i++)
         pl_shader_free(&dp->shaders[i]);
 
+    pthread_cond_destroy(&dp->job_done);
+    pthread_mutex_destroy(&dp->lock);
     talloc_free(dp);
     *ptr = NULL;
 }
@@ -119,15 +419,31 @@ struct pl_shader *pl_dispatch_begin(struct pl_dispatch *dp)
     struct pl_shader *sh;
     if (TARRAY_POP(dp->shaders, dp->num_shaders, &sh)) {
         pl_shader_reset(sh, ident);
-        return sh;
+    } else {
+        sh = pl_shader_alloc(dp->ctx, dp->ra, ident);
     }
 
-    return pl_shader_alloc(dp->ctx, dp->ra, ident);
+    // Set this every time, since the pool may also contain shaders that were
+    // allocated by the user
+    sh->text_cache = dp->text_cache;
+
+    if (dp->params.fuse_passes)
+        sh->deferred = &dp->deferred;
+    return sh;
 }
 
 void pl_dispatch_reset_frame(struct pl_dispatch *dp)
 {
+    pl_dispatch_flush(dp);
+
+    if (dp->in_batch) {
+        ra_batch_end(dp->ra);
+        dp->in_batch = false;
+    }
+
     dp->current_ident = 0;
+    dp->current_frame++;
+    evict_passes(dp);
 }
 
 static bool add_pass_var(struct pl_dispatch *dp, void *tmp, struct pass *pass,
@@ -221,7 +537,7 @@ static void generate_shaders(struct pl_dispatch *dp, struct pass *pass,
                              struct pl_shader *sh, ident_t vert_pos)
 {
     const struct ra *ra = dp->ra;
-    const struct pl_shader_res *res = pl_shader_finalize(sh);
+    const struct pl_shader_res *res = sh_finalize(sh);
 
     struct bstr *pre = &dp->tmp[TMP_PRELUDE];
     ADD(pre, "#version %d%s\n", ra->glsl.version, ra->glsl.gles ? " es" : "");
@@ -377,8 +693,25 @@ static void generate_shaders(struct pl_dispatch *dp, struct pass *pass,
         add_var(dp, glsl, var);
     }
 
-    // Set up the main shader body
-    ADD(glsl, "%s", res->glsl);
+    // Add all of the specialization constants. The default values are
+    // irrelevant, since the real values are always provided by the pass, and
+    // must not depend on the values in order to keep the text the same
+    static const char *const_defaults[] = {
+        [RA_VAR_SINT]  = "0",
+        [RA_VAR_UINT]  = "0u",
+        [RA_VAR_FLOAT] = "0.0",
+    };
+
+    for (int i = 0; i < res->num_constants; i++) {
+        const struct pl_shader_const *sc = &res->constants[i];
+        const struct ra_var var = { .type = sc->type, .dim_v = 1, .dim_m = 1 };
+        ADD(glsl, "layout(constant_id=%d) const %s %s = %s;\n", i,
+            ra_var_glsl_type_name(var), sc->name, const_defaults[sc->type]);
+    }
+
+    // Set up the main shader body. This is the only copy of the shader text
+    for (int i = 0; i < SH_NUM_SEGMENTS; i++)
+        ADD_BSTR(glsl, sh->segments[i]);
     ADD(glsl, "void main() {\n");
 
     assert(res->input == PL_SHADER_SIG_NONE);
@@ -401,15 +734,29 @@ static void generate_shaders(struct pl_dispatch *dp, struct pass *pass,
 #undef ADD
 #undef ADD_BSTR
 
+// Hash of the target properties which influence the created pass (e.g. the
+// render pass compatibility in vulkan), but not the shader text itself
+static uint64_t target_signature(const struct ra_tex_params *params)
+{
+    uint64_t id[] = {
+        bstr_hash64(bstr0(params->format->name)),
+        params->sampleable, params->renderable, params->storable,
+        params->blit_src, params->blit_dst,
+        params->host_writable, params->host_readable,
+    };
+
+    return siphash64((const uint8_t *) id, sizeof(id));
+}
+
 static struct pass *find_pass(struct pl_dispatch *dp, struct pl_shader *sh,
                               const struct ra_tex *target, ident_t vert_pos)
 {
     uint64_t sig = pl_shader_signature(sh);
+    pl_hash_merge(&sig, target_signature(&target->params));
 
-    for (int i = 0; i < dp->num_passes; i++) {
-        if (dp->passes[i]->signature == sig)
-            return dp->passes[i];
-    }
+    struct pass *cached = pass_table_lookup(&dp->by_signature, sig, false);
+    if (cached)
+        return cached;
 
     void *tmp = talloc_new(NULL); // for resources attached to `params`
 
@@ -454,18 +801,10 @@ static struct pass *find_pass(struct pl_dispatch *dp, struct pl_shader *sh,
         rparams->vertex_data = talloc_zero_size(pass, vert_size);
         break;
     }
-    case RA_PASS_COMPUTE: {
-        // Round up to make sure we don-t leave off a part of the target
-        int block_w = sh->res.compute_group_size[0],
-            block_h = sh->res.compute_group_size[1],
-            num_x   = (target->params.w + block_w - 1) / block_w,
-            num_y   = (target->params.h + block_h - 1) / block_h;
-
-        rparams->compute_groups[0] = num_x;
-        rparams->compute_groups[1] = num_y;
-        rparams->compute_groups[2] = 1;
+    case RA_PASS_COMPUTE:
+        // The number of compute groups depends on the target size, which is
+        // not part of the signature, so it's set by pl_dispatch_finish
         break;
-    }
     default: abort();
     }
 
@@ -478,21 +817,22 @@ static struct pass *find_pass(struct pl_dispatch *dp, struct pl_shader *sh,
     }
 
     // Create and attach the UBO if necessary
-    int ubo_index = -1;
     size_t ubo_size = ra_buf_desc_size(&pass->ubo_desc);
     if (ubo_size) {
-        pass->ubo = ra_buf_create(dp->ra, &(struct ra_buf_params) {
+        pass->ubo_params = (struct ra_buf_params) {
             .type = RA_BUF_UNIFORM,
             .size = ubo_size,
-            .host_writable = true,
-        });
+            .host_mapped = true,
+        };
 
+        pass->ubo = ra_buf_pool_get(dp->ra, &pass->ubo_pool, &pass->ubo_params);
         if (!pass->ubo) {
             PL_ERR(dp, "Failed creating uniform buffer for dispatch");
             goto error;
         }
 
-        ubo_index = res->num_descriptors;
+        pass->ubo_data = talloc_zero_size(pass, ubo_size);
+        pass->ubo_index = res->num_descriptors;
         sh_desc(sh, (struct pl_shader_desc) {
             .desc = pass->ubo_desc,
             .object = pass->ubo,
@@ -507,30 +847,119 @@ static struct pass *find_pass(struct pl_dispatch *dp, struct pl_shader *sh,
     for (int i = 0; i < num; i++)
         params.descriptors[i] = res->descriptors[i].desc;
 
-    // Pre-fill the desc_binding for the UBO
-    if (pass->ubo) {
-        assert(ubo_index >= 0);
-        rparams->desc_bindings[ubo_index].object = pass->ubo;
-    }
-
     // Create the push constants region
     params.push_constants_size = PL_ALIGN2(params.push_constants_size, 4);
     rparams->push_constants = talloc_zero_size(pass, params.push_constants_size);
 
+    // Re-use the compiled program from a previously loaded cache, if possible
+    int prog_idx = -1;
+    for (int i = 0; i < dp->num_programs; i++) {
+        if (dp->programs[i].signature == sig) {
+            params.cached_program = dp->programs[i].data.start;
+            params.cached_program_len = dp->programs[i].data.len;
+            prog_idx = i;
+            break;
+        }
+    }
+
     // Finally, finalize the shaders and create the pass itself
     generate_shaders(dp, pass, &params, sh, vert_pos);
-    pass->pass = rparams->pass = ra_pass_create(dp->ra, &params);
-    if (!pass->pass) {
+    dp->stats.num_compiled++;
+
+    // Fill in the specialization constants. These only exist after
+    // finalizing the shader, since they may also have been inlined instead
+    if (res->num_constants) {
+        params.num_constants = res->num_constants;
+        params.constants = talloc_zero_array(tmp, struct ra_constant,
+                                             params.num_constants);
+        void *data = talloc_size(tmp, params.num_constants * sizeof(uint32_t));
+        for (int i = 0; i < params.num_constants; i++) {
+            const struct pl_shader_const *sc = &res->constants[i];
+            size_t size = ra_var_type_size(sc->type);
+            assert(size <= sizeof(uint32_t));
+            params.constants[i] = (struct ra_constant) {
+                .type = sc->type,
+                .id = i,
+                .offset = i * sizeof(uint32_t),
+            };
+            memcpy((uint8_t *) data + params.constants[i].offset, sc->data, size);
+        }
+        params.constant_data = data;
+
+        // Another pass with the same text but different values can share
+        // its compiled program, which avoids re-compiling the shader
+        pass->program_hash = siphash64((const uint8_t *) params.glsl_shader,
+                                       strlen(params.glsl_shader));
+        if (params.vertex_shader) {
+            pl_hash_merge(&pass->program_hash,
+                          siphash64((const uint8_t *) params.vertex_shader,
+                                    strlen(params.vertex_shader)));
+        }
+
+        const struct pass *other = NULL;
+        if (!params.cached_program_len)
+            other = pass_table_lookup(&dp->by_program, pass->program_hash, true);
+        if (other) {
+            params.cached_program = other->pass->params.cached_program;
+            params.cached_program_len = other->pass->params.cached_program_len;
+        }
+    }
+
+    if (dp->pool) {
+        // Hand off the pass creation to a worker thread. The pass is marked
+        // as pending until pass_poll_job picks up the result
+        struct compile_job *job = talloc_zero(NULL, struct compile_job);
+        job->dp = dp;
+        job->params = ra_pass_params_copy(job, &params);
+        if (params.cached_program_len) {
+            job->params.cached_program_len = params.cached_program_len;
+            job->params.cached_program = talloc_memdup(job,
+                    params.cached_program, params.cached_program_len);
+        }
+
+        pass->job = job;
+        dp->stats.num_pending++;
+        pl_thread_pool_push(dp->pool, run_compile_job, job);
+    } else {
+        uint64_t start = time_ns();
+        pass->pass = rparams->pass = ra_pass_create(dp->ra, &params);
+        uint64_t duration = time_ns() - start;
+        dp->stats.compile_ns += duration;
+        dp->stats.stall_ns += duration;
+    }
+
+    // The created pass carries its own (up-to-date) copy of the program, so
+    // the loaded version is no longer needed
+    if (prog_idx >= 0) {
+        talloc_free(dp->programs[prog_idx].data.start);
+        TARRAY_REMOVE_AT(dp->programs, dp->num_programs, prog_idx);
+    }
+
+    if (!pass->pass && !pass->job) {
         PL_ERR(dp, "Failed creating render pass for dispatch");
         goto error;
     }
 
+    pass->timer = ra_timer_create(dp->ra);
     pass->failed = false;
 
 error:
     pass->ubo_desc = (struct ra_desc) {0}; // contains temporary pointers
     talloc_free(tmp);
+
+    // Rough estimate of the memory footprint, for the purposes of eviction
+    pass->size = sizeof(*pass) + params.push_constants_size +
+                 pass->ubo_params.size +
+                 dp->tmp[TMP_MAIN].len + dp->tmp[TMP_VERT_HEAD].len +
+                 (pass->pass ? pass->pass->params.cached_program_len : 0);
+    pass->last_used = dp->current_frame;
+
     TARRAY_APPEND(dp, dp->passes, dp->num_passes, pass);
+    pass_table_insert(dp, &dp->by_signature, pass);
+    if (pass->program_hash)
+        pass_table_insert(dp, &dp->by_program, pass);
+    dp->cache_size += pass->size;
+    evict_passes(dp);
     return pass;
 }
 
@@ -557,18 +986,11 @@ static void update_pass_var(struct pl_dispatch *dp, struct pass *pass,
         TARRAY_APPEND(pass, rparams->var_updates, rparams->num_var_updates, vu);
         break;
     }
-    case PASS_VAR_UBO: {
-        assert(pass->ubo);
-        uintptr_t src = (uintptr_t) sv->data;
-        uintptr_t end = src + (ptrdiff_t) host_layout.size;
-        size_t dst = pv->layout.offset;
-        while (src < end) {
-            ra_buf_write(dp->ra, pass->ubo, dst, (void *) src, host_layout.stride);
-            src += host_layout.stride;
-            dst += pv->layout.stride;
-        }
+    case PASS_VAR_UBO:
+        assert(pass->ubo_data);
+        memcpy_layout(pass->ubo_data, pv->layout, sv->data, host_layout);
+        pass->ubo_dirty = true;
         break;
-    }
     case PASS_VAR_PUSHC:
         assert(rparams->push_constants);
         memcpy_layout(rparams->push_constants, pv->layout, sv->data, host_layout);
@@ -576,6 +998,28 @@ static void update_pass_var(struct pl_dispatch *dp, struct pass *pass,
     };
 }
 
+// Uploads the staged UBO contents (if changed) into a buffer which is not
+// currently in use, and binds it
+static bool update_pass_ubo(struct pl_dispatch *dp, struct pass *pass)
+{
+    if (!pass->ubo_data)
+        return true;
+
+    if (pass->ubo_dirty) {
+        pass->ubo = ra_buf_pool_get(dp->ra, &pass->ubo_pool, &pass->ubo_params);
+        if (!pass->ubo) {
+            PL_ERR(dp, "Failed getting uniform buffer for dispatch");
+            return false;
+        }
+
+        memcpy(pass->ubo->data, pass->ubo_data, pass->ubo_params.size);
+        pass->ubo_dirty = false;
+    }
+
+    pass->run_params.desc_bindings[pass->ubo_index].object = pass->ubo;
+    return true;
+}
+
 static void translate_compute_shader(struct pl_dispatch *dp,
                                      struct pl_shader *sh,
                                      const struct ra_tex *target)
@@ -626,25 +1070,38 @@ static void translate_compute_shader(struct pl_dispatch *dp,
 
 bool pl_dispatch_finish(struct pl_dispatch *dp, struct pl_shader *sh,
                         const struct ra_tex *target)
+{
+    return pl_dispatch_finish_fallback(dp, sh, NULL, target);
+}
+
+// Checks whether `sh` can be dispatched to `target`, and creates the LUT
+// textures it needs (which shader builders leave to the thread using the RA)
+static bool validate_shader(struct pl_dispatch *dp, struct pl_shader *sh,
+                            const struct ra_tex *target)
 {
     const struct pl_shader_res *res = &sh->res;
-    bool ret = false;
 
     if (!sh->mutable) {
         PL_ERR(dp, "Trying to dispatch non-mutable shader?");
-        goto error;
+        return false;
     }
 
     if (res->input != PL_SHADER_SIG_NONE || res->output != PL_SHADER_SIG_COLOR) {
         PL_ERR(dp, "Trying to dispatch shader with incompatible signature!");
-        goto error;
+        return false;
     }
 
     const struct ra_tex_params *tpars = &target->params;
     if (ra_tex_params_dimension(*tpars) != 2 || !tpars->renderable) {
         PL_ERR(dp, "Trying to dispatch using a shader using an invalid target "
                "texture. The target must be a renderable 2D texture.");
-        goto error;
+        return false;
+    }
+
+    if (pl_shader_is_compute(sh) && !tpars->storable) {
+        PL_ERR(dp, "Trying to dispatch a compute shader using a non-storable "
+               "target texture.");
+        return false;
     }
 
     int w, h;
@@ -652,9 +1109,18 @@ bool pl_dispatch_finish(struct pl_dispatch *dp, struct pl_shader *sh,
         PL_ERR(dp, "Trying to dispatch a shader with explicit output size "
                "requirements %dx%d using a target of size %dx%d.",
                w, h, tpars->w, tpars->h);
-        goto error;
+        return false;
     }
 
+    return sh_lut_realize(sh);
+}
+
+// Finalizes the (already validated) `sh` and looks up (or creates) the
+// corresponding pass
+static struct pass *prepare_pass(struct pl_dispatch *dp, struct pl_shader *sh,
+                                 const struct ra_tex *target)
+{
+    uint64_t shader_sig = pl_shader_signature(sh);
     ident_t vert_pos = NULL;
 
     if (pl_shader_is_compute(sh)) {
@@ -671,6 +1137,52 @@ bool pl_dispatch_finish(struct pl_dispatch *dp, struct pl_shader *sh,
     }
 
     struct pass *pass = find_pass(dp, sh, target, vert_pos);
+    pass->shader_sig = shader_sig;
+    pass->last_used = dp->current_frame;
+    return pass;
+}
+
+static void timing_add(struct pl_dispatch_timing *t, uint64_t ns)
+{
+    t->count++;
+    t->last = ns;
+    t->peak = PL_MAX(t->peak, ns);
+    t->average += ((int64_t) ns - (int64_t) t->average) / t->count;
+}
+
+static void pass_poll_timer(struct pl_dispatch *dp, struct pass *pass)
+{
+    uint64_t ns;
+    while ((ns = ra_timer_query(dp->ra, pass->timer)))
+        timing_add(&pass->gpu, ns);
+}
+
+static void reset_tmp(struct pl_dispatch *dp)
+{
+    // Reset the temporary buffers which we use to build the shader
+    for (int i = 0; i < PL_ARRAY_SIZE(dp->tmp); i++)
+        dp->tmp[i].len = 0;
+}
+
+// Executes the (already validated) `sh` on `target`. If `wait` is false and
+// the pass is still being compiled, this sets `*pending` and returns false
+// without running anything. Does not take over ownership of `sh`.
+static bool run_shader(struct pl_dispatch *dp, struct pl_shader *sh,
+                       const struct ra_tex *target, bool wait, bool *pending)
+{
+    const struct pl_shader_res *res = &sh->res;
+    bool ret = false;
+
+    // Time spent stalling on compilation is accounted for separately
+    uint64_t start = time_ns(), stall_start = dp->stats.stall_ns;
+
+    struct pass *pass = prepare_pass(dp, sh, target);
+
+    // Only block on pending passes if there's nothing else we could run
+    if (!pass_poll_job(dp, pass, wait)) {
+        *pending = true;
+        goto error;
+    }
 
     // Silently return on failed passes
     if (pass->failed)
@@ -678,6 +1190,18 @@ bool pl_dispatch_finish(struct pl_dispatch *dp, struct pl_shader *sh,
 
     struct ra_pass_run_params *rparams = &pass->run_params;
 
+    if (rparams->pass->params.type == RA_PASS_COMPUTE) {
+        // Round up to make sure we don't leave off a part of the target
+        int block_w = res->compute_group_size[0],
+            block_h = res->compute_group_size[1],
+            num_x   = (target->params.w + block_w - 1) / block_w,
+            num_y   = (target->params.h + block_h - 1) / block_h;
+
+        rparams->compute_groups[0] = num_x;
+        rparams->compute_groups[1] = num_y;
+        rparams->compute_groups[2] = 1;
+    }
+
     // Update the descriptor bindings
     for (int i = 0; i < sh->res.num_descriptors; i++)
         rparams->desc_bindings[i].object = sh->res.descriptors[i].object;
@@ -686,6 +1210,8 @@ bool pl_dispatch_finish(struct pl_dispatch *dp, struct pl_shader *sh,
     rparams->num_var_updates = 0;
     for (int i = 0; i < res->num_variables; i++)
         update_pass_var(dp, pass, &res->variables[i], &pass->vars[i]);
+    if (!update_pass_ubo(dp, pass))
+        goto error;
 
     // Update the vertex data
     if (rparams->vertex_data) {
@@ -700,22 +1226,321 @@ bool pl_dispatch_finish(struct pl_dispatch *dp, struct pl_shader *sh,
         }
     }
 
+    if (dp->params.batch_passes && !dp->in_batch) {
+        ra_batch_begin(dp->ra);
+        dp->in_batch = true;
+    }
+
     // Dispatch the actual shader
+    pass_poll_timer(dp, pass);
     rparams->target = target;
+    rparams->timer = pass->timer;
     ra_pass_run(dp->ra, &pass->run_params);
+    timing_add(&pass->cpu, time_ns() - start - (dp->stats.stall_ns - stall_start));
     ret = true;
 
 error:
-    // Reset the temporary buffers which we use to build the shader
-    for (int i = 0; i < PL_ARRAY_SIZE(dp->tmp); i++)
-        dp->tmp[i].len = 0;
+    reset_tmp(dp);
+    return ret;
+}
+
+// Returns the deferred shader to the pool without executing it
+static void drop_deferred(struct pl_dispatch *dp)
+{
+    if (dp->deferred.sh)
+        pl_dispatch_abort(dp, dp->deferred.sh);
+    dp->deferred.sh = NULL;
+    dp->deferred.target = NULL;
+}
+
+bool pl_dispatch_flush(struct pl_dispatch *dp)
+{
+    struct pl_shader *sh = dp->deferred.sh;
+    if (!sh)
+        return true;
+
+    bool pending = false;
+    bool ret = run_shader(dp, sh, dp->deferred.target, true, &pending);
+    drop_deferred(dp);
+    return ret;
+}
+
+// Decides whether the fusion point of `sh` (if any) can inline the deferred
+// shader, and resolves it accordingly. Returns whether it was inlined
+static bool resolve_fusion(struct pl_dispatch *dp, struct pl_shader *sh,
+                           const struct ra_tex *target)
+{
+    const struct sh_deferred *def = &dp->deferred;
+    if (!sh->fuse.name)
+        return false;
+
+    bool ok = def->sh && sh->fuse.id == def->id && def->target != target;
+
+    // Inlining is only possible if no other part of `sh` needs the contents
+    // of the deferred target, and the deferred shader doesn't read from the
+    // target of `sh` (which would create a feedback loop)
+    for (int i = 0; ok && i < sh->res.num_descriptors; i++) {
+        if (i != sh->fuse.desc_idx)
+            ok = sh->res.descriptors[i].object != def->target;
+    }
+
+    for (int i = 0; ok && i < def->sh->res.num_descriptors; i++)
+        ok = def->sh->res.descriptors[i].object != target;
+
+    sh_fuse_resolve(sh, ok ? def->sh : NULL);
+    return ok;
+}
+
+bool pl_dispatch_finish_fallback(struct pl_dispatch *dp, struct pl_shader *sh,
+                                 struct pl_shader *fallback,
+                                 const struct ra_tex *target)
+{
+    bool pending = false;
+    bool ret = false;
+
+    if (!validate_shader(dp, sh, target))
+        goto error;
+
+    // The deferred shader must have been executed before anything that
+    // could read from its target, unless it was inlined
+    bool fused = resolve_fusion(dp, sh, target);
+    if (!fused && !pl_dispatch_flush(dp))
+        PL_ERR(dp, "Failed executing deferred pass");
+
+    if (dp->params.fuse_passes && !fallback && !pl_shader_is_compute(sh)) {
+        drop_deferred(dp);
+        dp->deferred = (struct sh_deferred) {
+            .sh     = sh,
+            .target = target,
+            .id     = ++dp->deferred_id,
+        };
+        return true;
+    }
+
+    ret = run_shader(dp, sh, target, !fallback, &pending);
+
+    // If the inlining shader didn't run, the deferred one has to after all,
+    // unless this is left up to the fallback
+    if (fused && !pending && !ret)
+        pl_dispatch_flush(dp);
+    if (fused && ret)
+        drop_deferred(dp);
+
+error:
+    pl_dispatch_abort(dp, sh);
+
+    if (pending)
+        return pl_dispatch_finish(dp, fallback, target);
+    if (fallback)
+        pl_dispatch_abort(dp, fallback);
+    return ret;
+}
+
+bool pl_dispatch_precompile(struct pl_dispatch *dp, struct pl_shader *sh,
+                            const struct ra_tex_params *target_params)
+{
+    // Blank texture standing in for the real target, like `target_dummy`
+    const struct ra_tex target = { .params = *target_params };
+
+    bool ret = false;
+    if (validate_shader(dp, sh, &target)) {
+        sh_fuse_resolve(sh, NULL);
+        struct pass *pass = prepare_pass(dp, sh, &target);
+        ret = !pass->failed;
+        reset_tmp(dp);
+    }
 
     pl_dispatch_abort(dp, sh);
     return ret;
 }
 
+void pl_dispatch_compile_stats(struct pl_dispatch *dp,
+                               struct pl_dispatch_compile_stats *out)
+{
+    pthread_mutex_lock(&dp->lock);
+    *out = dp->stats;
+    pthread_mutex_unlock(&dp->lock);
+}
+
+int pl_dispatch_stats(struct pl_dispatch *dp, struct pl_dispatch_pass_stats *out,
+                      int num)
+{
+    for (int i = 0; i < PL_MIN(num, dp->num_passes); i++) {
+        struct pass *pass = dp->passes[i];
+        pass_poll_timer(dp, pass);
+        out[i] = (struct pl_dispatch_pass_stats) {
+            .signature = pass->shader_sig,
+            .cpu = pass->cpu,
+            .gpu = pass->gpu,
+        };
+    }
+
+    return dp->num_passes;
+}
+
 void pl_dispatch_abort(struct pl_dispatch *dp, struct pl_shader *sh)
 {
     // Re-add the shader to the internal pool of shaders
     TARRAY_APPEND(dp, dp->shaders, dp->num_shaders, sh);
 }
+
+// Cache format: a header, followed by `num_entries` entries, each consisting
+// of the signature, the program length and the program itself. All values are
+// stored in host byte order
+static const char cache_magic[4] = {'P', 'L', 'D', 'P'};
+static const uint32_t cache_version = 5;
+
+struct cache_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t ra_id;
+    uint64_t num_entries;
+};
+
+// Hash of the RA properties which influence the generated shaders, so that
+// caches created against a different RA configuration can be rejected. (The
+// RA itself is expected to reject programs that don't match the device)
+static uint64_t ra_identity(const struct ra *ra)
+{
+    const struct ra_limits *lim = &ra->limits;
+    uint64_t id[] = {
+        ra->glsl.version, ra->glsl.gles, ra->glsl.vulkan, ra->caps,
+        lim->max_tex_1d_dim, lim->max_tex_2d_dim, lim->max_tex_3d_dim,
+        lim->max_pushc_size, lim->max_ubo_size, lim->max_ssbo_size,
+        lim->min_gather_offset, lim->max_gather_offset, lim->max_shmem_size,
+        ra->num_formats,
+    };
+
+    uint64_t hash = siphash64((const uint8_t *) id, sizeof(id));
+    for (int i = 0; i < ra->num_formats; i++)
+        hash = hash * 31 + bstr_hash64(bstr0(ra->formats[i]->name));
+    return hash;
+}
+
+// Appends data to `*out` (if non-NULL) and increments `*size`
+static void write_cache(uint8_t **out, size_t *size, const void *data, size_t len)
+{
+    if (*out) {
+        memcpy(*out, data, len);
+        *out += len;
+    }
+
+    *size += len;
+}
+
+static void write_entry(uint8_t **out, size_t *size, uint64_t sig,
+                        const uint8_t *prog, size_t prog_len)
+{
+    uint64_t len = prog_len;
+    write_cache(out, size, &sig, sizeof(sig));
+    write_cache(out, size, &len, sizeof(len));
+    write_cache(out, size, prog, prog_len);
+}
+
+size_t pl_dispatch_save(struct pl_dispatch *dp, uint8_t *out)
+{
+    struct cache_header header = {
+        .version = cache_version,
+        .ra_id   = ra_identity(dp->ra),
+    };
+
+    memcpy(header.magic, cache_magic, sizeof(header.magic));
+    for (int i = 0; i < dp->num_passes; i++) {
+        const struct ra_pass *pass = dp->passes[i]->pass;
+        header.num_entries += pass && pass->params.cached_program_len;
+    }
+    header.num_entries += dp->num_programs;
+
+    size_t size = 0;
+    write_cache(&out, &size, &header, sizeof(header));
+
+    for (int i = 0; i < dp->num_passes; i++) {
+        const struct ra_pass *pass = dp->passes[i]->pass;
+        if (!pass || !pass->params.cached_program_len)
+            continue;
+
+        write_entry(&out, &size, dp->passes[i]->signature,
+                    pass->params.cached_program,
+                    pass->params.cached_program_len);
+    }
+
+    // Also preserve the loaded programs that were not used (yet)
+    for (int i = 0; i < dp->num_programs; i++) {
+        const struct cached_program *prog = &dp->programs[i];
+        write_entry(&out, &size, prog->signature, prog->data.start,
+                    prog->data.len);
+    }
+
+    return size;
+}
+
+// Reads `len` bytes from the front of `*cache`, or returns false if truncated
+static bool read_cache(struct bstr *cache, void *data, size_t len)
+{
+    if (cache->len < len)
+        return false;
+
+    memcpy(data, cache->start, len);
+    *cache = bstr_cut(*cache, len);
+    return true;
+}
+
+bool pl_dispatch_load(struct pl_dispatch *dp, const uint8_t *cache, size_t size)
+{
+    struct bstr data = { .start = (uint8_t *) cache, .len = size };
+
+    struct cache_header header;
+    if (!read_cache(&data, &header, sizeof(header)) ||
+        memcmp(header.magic, cache_magic, sizeof(header.magic)) != 0)
+    {
+        PL_ERR(dp, "Failed loading dispatch cache: invalid or corrupt data");
+        return false;
+    }
+
+    if (header.version != cache_version) {
+        PL_INFO(dp, "Ignoring dispatch cache with incompatible version "
+                "(got %u, expected %u)", header.version, cache_version);
+        return false;
+    }
+
+    if (header.ra_id != ra_identity(dp->ra)) {
+        PL_INFO(dp, "Ignoring dispatch cache created for a different RA");
+        return false;
+    }
+
+    int num_loaded = 0;
+    for (uint64_t n = 0; n < header.num_entries; n++) {
+        uint64_t sig, len;
+        if (!read_cache(&data, &sig, sizeof(sig)) ||
+            !read_cache(&data, &len, sizeof(len)) ||
+            data.len < len)
+        {
+            PL_ERR(dp, "Failed loading dispatch cache: truncated data");
+            return false;
+        }
+
+        struct bstr prog = bstr_splice(data, 0, len);
+        data = bstr_cut(data, len);
+
+        // Skip programs for passes we already know about
+        if (pass_table_lookup(&dp->by_signature, sig, false))
+            continue;
+
+        bool dupe = false;
+        for (int i = 0; i < dp->num_programs; i++)
+            dupe |= dp->programs[i].signature == sig;
+        if (dupe)
+            continue;
+
+        struct cached_program cp = {
+            .signature = sig,
+            .data = bstrdup(dp, prog),
+        };
+
+        TARRAY_APPEND(dp, dp->programs, dp->num_programs, cp);
+        num_loaded++;
+    }
+
+    PL_DEBUG(dp, "Loaded %d programs from dispatch cache", num_loaded);
+    return true;
+}
@@ -35,9 +35,11 @@
  */
 
 #include <math.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "context.h"
+#include "thread_pool.h"
 
 bool pl_filter_function_eq(const struct pl_filter_function *a,
                            const struct pl_filter_function *b)
@@ -99,19 +101,101 @@ double pl_filter_sample(const struct pl_filter_config *c, double x)
     return k < 0 ? (1 - c->clamp) * k : k;
 }
 
+typedef void (*weight_batch_fn)(const struct pl_filter_function *f,
+                                const double *x, double *out, int num);
+
+static weight_batch_fn find_weight_batch(const struct pl_filter_function *f,
+                                         bool approximate);
+
+// Maximum number of samples evaluated at once by sample_batch
+#define SAMPLE_BATCH 64
+
+// For evaluating a filter configuration in batches, see sample_batch
+struct sampler {
+    const struct pl_filter_config *config;
+    weight_batch_fn kernel; // NULL if there is no batched version
+    weight_batch_fn window; // NULL if there is no batched version
+};
+
+static struct sampler sampler_init(const struct pl_filter_params *params)
+{
+    const struct pl_filter_config *c = &params->config;
+    return (struct sampler) {
+        .config = c,
+        .kernel = find_weight_batch(c->kernel, params->approximate),
+        .window = c->window ? find_weight_batch(c->window, params->approximate)
+                            : NULL,
+    };
+}
+
+static void eval_batch(const struct pl_filter_function *f, weight_batch_fn batch,
+                       const double *x, double *out, int num)
+{
+    if (batch) {
+        batch(f, x, out, num);
+    } else {
+        for (int i = 0; i < num; i++)
+            out[i] = f->weight(f, x[i]);
+    }
+}
+
+// Batched equivalent of pl_filter_sample, for up to SAMPLE_BATCH values of
+// `x`. Instead of returning early for values outside of the kernel radius,
+// the functions are evaluated at the radius and the result is discarded
+static void sample_batch(const struct sampler *s, const double *x, double *out,
+                         int num)
+{
+    const struct pl_filter_config *c = s->config;
+    double radius = c->kernel->radius;
+    double kx[SAMPLE_BATCH], k[SAMPLE_BATCH];
+    bool inside[SAMPLE_BATCH];
+    assert(num > 0 && num <= SAMPLE_BATCH);
+
+    for (int i = 0; i < num; i++) {
+        double ax = fabs(x[i]);
+        double t = c->blur > 0.0 ? ax / c->blur : ax;
+        t = t <= c->taper ? 0.0 : (t - c->taper) / (1.0 - c->taper / radius);
+        inside[i] = t <= radius;
+        kx[i] = inside[i] ? t : radius;
+    }
+
+    eval_batch(c->kernel, s->kernel, kx, k, num);
+
+    if (c->window) {
+        double wx[SAMPLE_BATCH], w[SAMPLE_BATCH];
+        for (int i = 0; i < num; i++)
+            wx[i] = fabs(x[i]) / radius * c->window->radius;
+        eval_batch(c->window, s->window, wx, w, num);
+        for (int i = 0; i < num; i++)
+            k[i] *= w[i];
+    }
+
+    for (int i = 0; i < num; i++) {
+        double v = k[i] < 0 ? (1 - c->clamp) * k[i] : k[i];
+        out[i] = inside[i] ? v : 0.0;
+    }
+}
+
 // Calculate a single filter row of a 1D filter, for a given phase value /
 // subpixel offset `offset`. Writes exactly f->row_size values to *out.
-static void compute_row(struct pl_filter *f, double offset, float *out)
+static void compute_row(struct pl_filter *f, const struct sampler *s,
+                        double offset, float *out)
 {
     assert(f->row_size > 0);
+    // Readjust the value range to account for a stretched kernel.
+    double scale = f->params.config.kernel->radius / f->radius;
     double sum = 0;
-    for (int i = 0; i < f->row_size; i++) {
-        double x = offset - (i - f->row_size / 2.0 + 1);
-        // Readjust the value range to account for a stretched kernel.
-        x *= f->params.config.kernel->radius / f->radius;
-        double weight = pl_filter_sample(&f->params.config, x);
-        out[i] = weight;
-        sum += weight;
+    for (int pos = 0; pos < f->row_size; pos += SAMPLE_BATCH) {
+        int num = PL_MIN(f->row_size - pos, SAMPLE_BATCH);
+        double x[SAMPLE_BATCH], weights[SAMPLE_BATCH];
+        for (int i = 0; i < num; i++)
+            x[i] = (offset - (pos + i - f->row_size / 2.0 + 1)) * scale;
+
+        sample_batch(s, x, weights, num);
+        for (int i = 0; i < num; i++) {
+            out[pos + i] = weights[i];
+            sum += weights[i];
+        }
     }
     // Normalize to preserve energy
     if (sum > 0.0) {
@@ -120,6 +204,338 @@ static void compute_row(struct pl_filter *f, double offset, float *out)
     }
 }
 
+// Minimum number of weights computed by a single job when generating rows on
+// the context's filter threads. Smaller LUTs aren't worth the overhead.
+#define MIN_JOB_WEIGHTS 16384
+
+struct rows_job {
+    struct pl_filter *f;
+    const struct sampler *s;
+    float *weights;
+    int start, end; // range of rows to compute
+    int *pending;
+    pthread_mutex_t *lock;
+    pthread_cond_t *done;
+};
+
+// Computes the rows in [start, end) of a separable LUT with `rows` entries
+static void compute_rows(struct pl_filter *f, const struct sampler *s,
+                         float *weights, int rows, int start, int end)
+{
+    for (int i = start; i < end; i++) {
+        compute_row(f, s, i / (double)(rows - 1),
+                    weights + f->row_stride * i);
+    }
+}
+
+static void run_rows_job(void *priv)
+{
+    struct rows_job *job = priv;
+    compute_rows(job->f, job->s, job->weights, job->f->params.lut_entries,
+                 job->start, job->end);
+
+    pthread_mutex_lock(job->lock);
+    if (--*job->pending == 0)
+        pthread_cond_signal(job->done);
+    pthread_mutex_unlock(job->lock);
+}
+
+// Computes the rows in [0, num) of a separable LUT, splitting the work
+// between the calling thread and the context's filter threads (if any). Every
+// row is computed by exactly the same code regardless of which thread it ends
+// up on, so the result is the same as when computing it serially.
+static void compute_rows_parallel(struct pl_context *ctx, struct pl_filter *f,
+                                  const struct sampler *s, float *weights,
+                                  int num)
+{
+    int rows = f->params.lut_entries;
+    int num_jobs = 1;
+    if (ctx->filter_pool) {
+        num_jobs = (int64_t) num * f->row_size / MIN_JOB_WEIGHTS;
+        num_jobs = PL_MAX(PL_MIN(num_jobs, ctx->params.filter_threads + 1), 1);
+    }
+
+    if (num_jobs == 1) {
+        compute_rows(f, s, weights, rows, 0, num);
+        return;
+    }
+
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&done, NULL);
+
+    // The first chunk is computed by the calling thread itself, which keeps
+    // it busy while waiting on the others
+    struct rows_job *jobs = talloc_array(NULL, struct rows_job, num_jobs);
+    int pending = num_jobs - 1;
+    for (int i = 0; i < num_jobs; i++) {
+        jobs[i] = (struct rows_job) {
+            .f = f,
+            .s = s,
+            .weights = weights,
+            .start = (int64_t) num * i / num_jobs,
+            .end = (int64_t) num * (i + 1) / num_jobs,
+            .pending = &pending,
+            .lock = &lock,
+            .done = &done,
+        };
+
+        if (i > 0)
+            pl_thread_pool_push(ctx->filter_pool, run_rows_job, &jobs[i]);
+    }
+
+    compute_rows(f, s, weights, rows, jobs[0].start, jobs[0].end);
+
+    pthread_mutex_lock(&lock);
+    while (pending)
+        pthread_cond_wait(&done, &lock);
+    pthread_mutex_unlock(&lock);
+
+    pthread_cond_destroy(&done);
+    pthread_mutex_destroy(&lock);
+    talloc_free(jobs);
+}
+
+// Samples a polar filter at `num` points spaced evenly such that `entries`
+// points cover [0, radius], starting at the (fractional) entry `start`
+static void sample_polar(const struct sampler *s, double radius, int entries,
+                         double start, int num, float *out)
+{
+    for (int pos = 0; pos < num; pos += SAMPLE_BATCH) {
+        int n = PL_MIN(num - pos, SAMPLE_BATCH);
+        double x[SAMPLE_BATCH], w[SAMPLE_BATCH];
+        for (int i = 0; i < n; i++)
+            x[i] = radius * (start + pos + i) / (entries - 1);
+
+        sample_batch(s, x, w, n);
+        for (int i = 0; i < n; i++)
+            out[pos + i] = w[i];
+    }
+}
+
+// Returns the maximum error of linearly interpolating a LUT with `entries`
+// entries, compared to sampling the filter directly. The error is measured
+// half-way between each pair of adjacent entries, which is where it peaks
+// for smooth functions. If `weights` is NULL, the entries are computed on the
+// fly, otherwise `weights` must contain them.
+static double lut_error(struct pl_filter *f, const struct sampler *s,
+                        int entries, const float *weights)
+{
+    assert(entries >= 2);
+    void *tmp = talloc_new(NULL);
+    double max = 0.0;
+
+    if (f->params.config.polar) {
+        double radius = f->params.config.kernel->radius;
+        if (!weights) {
+            float *lut = talloc_array(tmp, float, entries);
+            sample_polar(s, radius, entries, 0.0, entries, lut);
+            weights = lut;
+        }
+
+        float *mid = talloc_array(tmp, float, entries - 1);
+        sample_polar(s, radius, entries, 0.5, entries - 1, mid);
+        for (int i = 0; i < entries - 1; i++) {
+            double lerp = (weights[i] + weights[i + 1]) / 2.0;
+            max = fmax(max, fabs(mid[i] - lerp));
+        }
+    } else {
+        // Only the first half needs to be checked, since the filter is
+        // symmetric. Without `weights`, row `i + 1` becomes the next row `i`
+        float *rows = talloc_array(tmp, float, 3 * f->row_size);
+        float *a = rows, *b = rows + f->row_size, *mid = b + f->row_size;
+        if (!weights)
+            compute_row(f, s, 0.0, b);
+
+        for (int i = 0; i <= (entries - 2) / 2; i++) {
+            if (weights) {
+                a = (float *) weights + i * f->row_stride;
+                b = a + f->row_stride;
+            } else {
+                float *prev = b;
+                b = a;
+                a = prev;
+                compute_row(f, s, (i + 1) / (double)(entries - 1), b);
+            }
+
+            compute_row(f, s, (i + 0.5) / (entries - 1), mid);
+            for (int n = 0; n < f->row_size; n++) {
+                double lerp = (a[n] + b[n]) / 2.0;
+                max = fmax(max, fabs(mid[n] - lerp));
+            }
+        }
+    }
+
+    talloc_free(tmp);
+    return max;
+}
+
+// Default upper limit for the LUT size picked based on `max_error`
+#define MAX_AUTO_ENTRIES 1024
+
+// Picks the smallest LUT size (up to `max_entries`) for which lut_error
+// stays below params.max_error, by doubling the size until it does and then
+// bisecting the last step. This assumes the error shrinks with the size,
+// which holds for all practical purposes (it's roughly quadratic)
+static int pick_lut_entries(struct pl_filter *f, const struct sampler *s,
+                            int max_entries)
+{
+    double bound = f->params.max_error;
+    int lo = 1, hi = 2; // `lo` is known to be insufficient
+    for (;;) {
+        if (hi >= max_entries) {
+            hi = max_entries;
+            if (hi < 2 || lut_error(f, s, hi, NULL) > bound)
+                return hi; // as good as it gets
+            break;
+        }
+
+        if (lut_error(f, s, hi, NULL) <= bound)
+            break;
+        lo = hi;
+        hi *= 2;
+    }
+
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (lut_error(f, s, mid, NULL) <= bound) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+
+    return hi;
+}
+
+// Converts a float to a half float, rounding to nearest (ties to even)
+static uint16_t float_to_half(float x)
+{
+    union { float f; uint32_t u; } v = { .f = x };
+    uint16_t sign = (v.u >> 16) & 0x8000;
+    uint32_t abs = v.u & 0x7FFFFFFF;
+
+    if (abs >= 0x7F800000) // inf or nan
+        return sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 : 0);
+    if (abs >= 0x477FF000) // rounds up to inf (>= 65520)
+        return sign | 0x7C00;
+    if (abs < 0x38800000) {
+        // Subnormal half float, in units of 2^-24. The scaling is exact, so
+        // this only rounds once (using the default rounding mode)
+        return sign | (uint16_t) nearbyintf(fabsf(x) * 0x1p24f);
+    }
+
+    // Re-bias the exponent and round off the lower 13 bits of the mantissa.
+    // A carry out of the mantissa correctly bumps the exponent
+    uint32_t h = (abs - 0x38000000) >> 13;
+    uint32_t rem = abs & 0x1FFF;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        h++;
+    return sign | h;
+}
+
+static float half_to_float(uint16_t h)
+{
+    int exp = (h >> 10) & 0x1F, mant = h & 0x3FF;
+    float x;
+    if (exp == 0) {
+        x = ldexpf(mant, -24);
+    } else if (exp == 0x1F) {
+        x = mant ? NAN : INFINITY;
+    } else {
+        x = ldexpf(mant | 0x400, exp - 25);
+    }
+    return (h & 0x8000) ? -x : x;
+}
+
+#define SNORM16_MAX 32767
+
+// Quantizes a row of `num` weights to 16-bit signed normalized values. If
+// `renorm` is set, the quantization errors are distributed such that the
+// quantized weights sum up to the same value as the original weights (to the
+// extent representable), preferring to adjust the weights which were rounded
+// the furthest.
+static void quantize_snorm16(const float *in, int16_t *out, int num,
+                             bool renorm)
+{
+    double sum = 0.0;
+    long qsum = 0;
+    for (int i = 0; i < num; i++) {
+        double w = PL_MAX(PL_MIN(in[i], 1.0), -1.0);
+        out[i] = lrint(w * SNORM16_MAX);
+        sum += in[i];
+        qsum += out[i];
+    }
+
+    if (!renorm)
+        return;
+
+    long diff = lrint(sum * SNORM16_MAX) - qsum;
+    while (diff) {
+        int dir = diff > 0 ? 1 : -1, best = -1;
+        double best_err = 0.0;
+        for (int i = 0; i < num; i++) {
+            if (out[i] + dir > SNORM16_MAX || out[i] + dir < -SNORM16_MAX)
+                continue;
+            double err = (in[i] * SNORM16_MAX - out[i]) * dir;
+            if (best < 0 || err > best_err) {
+                best = i;
+                best_err = err;
+            }
+        }
+
+        if (best < 0)
+            break; // can't be represented
+        out[best] += dir;
+        diff -= dir;
+    }
+}
+
+// Encodes `f->weights` as `f->lut`, and replaces the weights by the values
+// actually represented by the encoded LUT
+static void encode_lut(struct pl_filter *f, float *weights)
+{
+    int rows = f->params.config.polar ? 1 : f->params.lut_entries;
+    int stride = f->params.config.polar ? f->params.lut_entries : f->row_stride;
+    int num = rows * stride;
+
+    switch (f->params.lut_type) {
+    case PL_FILTER_LUT_FLOAT:
+        f->lut = weights;
+        f->lut_size = num * sizeof(float);
+        return;
+
+    case PL_FILTER_LUT_HALF: {
+        uint16_t *lut = talloc_array(f, uint16_t, num);
+        for (int i = 0; i < num; i++) {
+            lut[i] = float_to_half(weights[i]);
+            weights[i] = half_to_float(lut[i]);
+        }
+        f->lut = lut;
+        f->lut_size = num * sizeof(uint16_t);
+        return;
+    }
+
+    case PL_FILTER_LUT_SNORM16: {
+        // The padding at the end of each row stays zero
+        int16_t *lut = talloc_zero_array(f, int16_t, num);
+        int row_size = f->params.config.polar ? stride : f->row_size;
+        for (int r = 0; r < rows; r++) {
+            quantize_snorm16(weights + r * stride, lut + r * stride, row_size,
+                             !f->params.config.polar);
+        }
+        for (int i = 0; i < num; i++)
+            weights[i] = lut[i] / (float) SNORM16_MAX;
+        f->lut = lut;
+        f->lut_size = num * sizeof(int16_t);
+        return;
+    }
+    }
+
+    abort();
+}
+
 static struct pl_filter_function *dupfilter(void *tactx,
                                             const struct pl_filter_function *f)
 {
@@ -130,12 +546,14 @@ const struct pl_filter *pl_filter_generate(struct pl_context *ctx,
                                        const struct pl_filter_params *params)
 {
     assert(params);
-    if (params->lut_entries <= 0 || !params->config.kernel) {
+    bool auto_size = params->max_error > 0;
+    if ((params->lut_entries <= 0 && !auto_size) || !params->config.kernel) {
         pl_fatal(ctx, "Invalid params: missing lut_entries or config.kernel");
         return NULL;
     }
 
-    struct pl_filter *f = talloc_zero(ctx, struct pl_filter);
+    // Not attached to `ctx`, since that's shared between threads
+    struct pl_filter *f = talloc_zero(NULL, struct pl_filter);
     f->params = *params;
     f->params.config.kernel = dupfilter(f, params->config.kernel);
     f->params.config.window = dupfilter(f, params->config.window);
@@ -147,15 +565,21 @@ const struct pl_filter *pl_filter_generate(struct pl_context *ctx,
         f->radius *= params->filter_scale;
 
     float *weights;
+    struct sampler s = sampler_init(&f->params);
     if (params->config.polar) {
+        if (auto_size) {
+            int max = PL_DEF(params->lut_entries, MAX_AUTO_ENTRIES);
+            f->params.lut_entries = pick_lut_entries(f, &s, max);
+        }
+
         // Compute a 1D array indexed by radius
-        weights = talloc_array(f, float, params->lut_entries);
+        int entries = f->params.lut_entries;
+        weights = talloc_array(f, float, entries);
+        sample_polar(&s, radius, entries, 0.0, entries, weights);
         f->radius_cutoff = 0.0;
-        for (int i = 0; i < params->lut_entries; i++) {
-            double x = radius * i / (params->lut_entries - 1);
-            weights[i] = pl_filter_sample(&f->params.config, x);
+        for (int i = 0; i < entries; i++) {
             if (fabs(weights[i]) > params->cutoff)
-                f->radius_cutoff = x;
+                f->radius_cutoff = radius * i / (entries - 1);
         }
     } else {
         // Pick the most appropriate row size
@@ -167,17 +591,41 @@ const struct pl_filter *pl_filter_generate(struct pl_context *ctx,
             f->row_size = params->max_row_size;
             f->insufficient = true;
         }
-        f->row_stride = PL_ALIGN(f->row_size, params->row_stride_align);
 
-        // Compute a 2D array indexed by the subpixel position
-        weights = talloc_zero_array(f, float, params->lut_entries * f->row_stride);
-        for (int i = 0; i < params->lut_entries; i++) {
-            compute_row(f, i / (double)(params->lut_entries - 1),
-                        weights + f->row_stride * i);
+        int align = params->row_stride_align;
+        if (params->pack_rgba) {
+            // Round the alignment up to the least common multiple with 4
+            align = PL_DEF(align, 1);
+            align *= 4 / (align % 4 == 0 ? 4 : align % 2 == 0 ? 2 : 1);
+        }
+        f->row_stride = PL_ALIGN(f->row_size, align);
+
+        if (auto_size) {
+            int max = PL_DEF(params->lut_entries, MAX_AUTO_ENTRIES);
+            f->params.lut_entries = pick_lut_entries(f, &s, max);
+        }
+
+        // Compute a 2D array indexed by the subpixel position. Since the
+        // filter is symmetric, the row for offset (1 - x) is the mirror image
+        // of the row for offset x, so only the first half gets computed
+        int rows = f->params.lut_entries;
+        int half = (rows + 1) / 2;
+        weights = talloc_zero_array(f, float, rows * f->row_stride);
+        compute_rows_parallel(ctx, f, &s, weights, half);
+        for (int i = half; i < rows; i++) {
+            float *row = weights + f->row_stride * i;
+            const float *src = weights + f->row_stride * (rows - 1 - i);
+            for (int n = 0; n < f->row_size; n++)
+                row[n] = src[f->row_size - 1 - n];
         }
     }
 
+    encode_lut(f, weights);
     f->weights = weights;
+
+    // Measured on the final weights, so this includes the quantization error
+    if (auto_size && f->params.lut_entries >= 2)
+        f->lut_error = lut_error(f, &s, f->params.lut_entries, weights);
     return f;
 }
 
@@ -214,11 +662,25 @@ const struct pl_named_filter_config *pl_find_named_filter(const char *name)
 
 // Built-in filter functions
 
+// Defines a batched version of the filter function `name`, which evaluates a
+// whole array of samples per call. This avoids an indirect call per sample,
+// and lets the compiler hoist the setup (e.g. the polynomial coefficients of
+// bcspline) out of the loop and vectorize the body where possible.
+#define DEFINE_BATCH(name)                                                  \
+    static void name##_batch(const struct pl_filter_function *f,            \
+                             const double *x, double *out, int num)         \
+    {                                                                       \
+        for (int i = 0; i < num; i++)                                       \
+            out[i] = name(f, x[i]);                                         \
+    }
+
 static double box(const struct pl_filter_function *f, double x)
 {
     return 1.0;
 }
 
+DEFINE_BATCH(box)
+
 const struct pl_filter_function pl_filter_function_box = {
     .resizable = true,
     .weight    = box,
@@ -230,6 +692,8 @@ static double triangle(const struct pl_filter_function *f, double x)
     return 1.0 - x / f->radius;
 }
 
+DEFINE_BATCH(triangle)
+
 const struct pl_filter_function pl_filter_function_triangle = {
     .resizable = true,
     .weight    = triangle,
@@ -241,6 +705,8 @@ static double hann(const struct pl_filter_function *f, double x)
     return 0.5 + 0.5 * cos(M_PI * x);
 }
 
+DEFINE_BATCH(hann)
+
 const struct pl_filter_function pl_filter_function_hann = {
     .weight = hann,
     .radius = 1.0,
@@ -251,6 +717,8 @@ static double hamming(const struct pl_filter_function *f, double x)
     return 0.54 + 0.46 * cos(M_PI * x);
 }
 
+DEFINE_BATCH(hamming)
+
 const struct pl_filter_function pl_filter_function_hamming = {
     .weight = hamming,
     .radius = 1.0,
@@ -261,6 +729,8 @@ static double welch(const struct pl_filter_function *f, double x)
     return 1.0 - x * x;
 }
 
+DEFINE_BATCH(welch)
+
 const struct pl_filter_function pl_filter_function_welch = {
     .weight = welch,
     .radius = 1.0,
@@ -286,6 +756,8 @@ static double kaiser(const struct pl_filter_function *f, double x)
     return bessel_i0(alpha * sqrt(1.0 - x * x)) / alpha;
 }
 
+DEFINE_BATCH(kaiser)
+
 const struct pl_filter_function pl_filter_function_kaiser = {
     .tunable = {true},
     .weight  = kaiser,
@@ -301,6 +773,8 @@ static double blackman(const struct pl_filter_function *f, double x)
     return a0 + a1 * cos(x) + a2 * cos(2 * x);
 }
 
+DEFINE_BATCH(blackman)
+
 const struct pl_filter_function pl_filter_function_blackman = {
     .tunable = {true},
     .weight  = blackman,
@@ -313,6 +787,8 @@ static double gaussian(const struct pl_filter_function *f, double x)
     return exp(-2.0 * x * x / f->params[0]);
 }
 
+DEFINE_BATCH(gaussian)
+
 const struct pl_filter_function pl_filter_function_gaussian = {
     .resizable = true,
     .tunable   = {true},
@@ -329,6 +805,8 @@ static double sinc(const struct pl_filter_function *f, double x)
     return sin(x) / x;
 }
 
+DEFINE_BATCH(sinc)
+
 const struct pl_filter_function pl_filter_function_sinc = {
     .resizable = true,
     .weight    = sinc,
@@ -343,6 +821,8 @@ static double jinc(const struct pl_filter_function *f, double x)
     return 2.0 * j1(x) / x;
 }
 
+DEFINE_BATCH(jinc)
+
 const struct pl_filter_function pl_filter_function_jinc = {
     .resizable = true,
     .weight    = jinc,
@@ -357,6 +837,8 @@ static double sphinx(const struct pl_filter_function *f, double x)
     return 3.0 * (sin(x) - x * cos(x)) / (x * x * x);
 }
 
+DEFINE_BATCH(sphinx)
+
 const struct pl_filter_function pl_filter_function_sphinx = {
     .resizable = true,
     .weight    = sphinx,
@@ -385,6 +867,8 @@ static double bcspline(const struct pl_filter_function *f, double x)
     return 0.0;
 }
 
+DEFINE_BATCH(bcspline)
+
 const struct pl_filter_function pl_filter_function_bcspline = {
     .tunable = {true, true},
     .weight  = bcspline,
@@ -429,6 +913,8 @@ static double bicubic(const struct pl_filter_function *f, double x)
                         - 4 * POW3(x - 1));
 }
 
+DEFINE_BATCH(bicubic)
+
 const struct pl_filter_function pl_filter_function_bicubic = {
     .weight = bicubic,
     .radius = 2.0,
@@ -443,6 +929,8 @@ static double spline16(const struct pl_filter_function *f, double x)
     }
 }
 
+DEFINE_BATCH(spline16)
+
 const struct pl_filter_function pl_filter_function_spline16 = {
     .weight = spline16,
     .radius = 2.0,
@@ -459,6 +947,8 @@ static double spline36(const struct pl_filter_function *f, double x)
     }
 }
 
+DEFINE_BATCH(spline36)
+
 const struct pl_filter_function pl_filter_function_spline36 = {
     .weight = spline36,
     .radius = 3.0,
@@ -477,11 +967,156 @@ static double spline64(const struct pl_filter_function *f, double x)
     }
 }
 
+DEFINE_BATCH(spline64)
+
 const struct pl_filter_function pl_filter_function_spline64 = {
     .weight = spline64,
     .radius = 4.0,
 };
 
+// Fast approximations of the functions that are expensive to evaluate
+// exactly, see `pl_filter_params.approximate`. These are piecewise Chebyshev
+// expansions of degree CHEB_DEGREE, on CHEB_PIECES intervals of equal width
+// starting at 0. Rather than hard-coding the coefficients, they're derived
+// from the exact functions on first use, which takes a few hundred samples.
+// Arguments beyond the last interval fall back to the exact functions.
+#define CHEB_DEGREE 10
+#define CHEB_PIECES 16
+
+struct cheb_approx {
+    double width;
+    double coeffs[CHEB_PIECES][CHEB_DEGREE + 1];
+};
+
+static void cheb_init(struct cheb_approx *c, double width, double (*fn)(double))
+{
+    const int n = CHEB_DEGREE + 1;
+    c->width = width;
+
+    for (int p = 0; p < CHEB_PIECES; p++) {
+        double vals[CHEB_DEGREE + 1];
+        for (int k = 0; k < n; k++) {
+            double t = cos(M_PI * (k + 0.5) / n);
+            vals[k] = fn(width * (p + (t + 1.0) / 2.0));
+        }
+
+        for (int j = 0; j < n; j++) {
+            double sum = 0.0;
+            for (int k = 0; k < n; k++)
+                sum += vals[k] * cos(M_PI * j * (k + 0.5) / n);
+            c->coeffs[p][j] = 2.0 * sum / n;
+        }
+    }
+}
+
+// Must only be called for 0 <= x < CHEB_PIECES * c->width
+static inline double cheb_eval(const struct cheb_approx *c, double x)
+{
+    double pos = x / c->width;
+    int p = pos;
+    const double *coeffs = c->coeffs[p];
+
+    // Clenshaw's recurrence, with `t` mapped to [-1, 1]
+    double t = 2.0 * (pos - p) - 1.0;
+    double b1 = 0.0, b2 = 0.0;
+    for (int j = CHEB_DEGREE; j > 0; j--) {
+        double b0 = 2.0 * t * b1 - b2 + coeffs[j];
+        b2 = b1;
+        b1 = b0;
+    }
+
+    return t * b1 - b2 + coeffs[0] / 2.0;
+}
+
+// jinc has a bandwidth of about pi, so pieces of width 1 are accurate to
+// better than 1e-9, covering all practical filter radii
+static struct cheb_approx jinc_approx;
+
+static double jinc_exact(double x)
+{
+    return jinc(NULL, x);
+}
+
+// I0 grows exponentially, so approximate exp(-x) * I0(x) instead, which is
+// smooth and bounded
+static struct cheb_approx i0_approx;
+
+static double i0_scaled(double x)
+{
+    return exp(-x) * bessel_i0(x);
+}
+
+static pthread_once_t approx_once = PTHREAD_ONCE_INIT;
+
+static void approx_init(void)
+{
+    cheb_init(&jinc_approx, 1.0, jinc_exact);
+    cheb_init(&i0_approx, 2.0, i0_scaled);
+}
+
+static void jinc_fast_batch(const struct pl_filter_function *f,
+                            const double *x, double *out, int num)
+{
+    pthread_once(&approx_once, approx_init);
+    const double max = CHEB_PIECES * jinc_approx.width;
+    for (int i = 0; i < num; i++)
+        out[i] = x[i] < max ? cheb_eval(&jinc_approx, x[i]) : jinc(f, x[i]);
+}
+
+static void kaiser_fast_batch(const struct pl_filter_function *f,
+                              const double *x, double *out, int num)
+{
+    pthread_once(&approx_once, approx_init);
+    const double max = CHEB_PIECES * i0_approx.width;
+    double alpha = fmax(f->params[0], 0.0);
+    for (int i = 0; i < num; i++) {
+        double y = alpha * sqrt(1.0 - x[i] * x[i]);
+        out[i] = y < max ? exp(y) * cheb_eval(&i0_approx, y) / alpha
+                         : kaiser(f, x[i]);
+    }
+}
+
+// Batched versions of the built-in filter functions, indexed by `weight`, so
+// that they also apply to modified copies of the built-in functions. `fast`
+// is an approximation, if there is one
+static const struct {
+    double (*weight)(const struct pl_filter_function *f, double x);
+    weight_batch_fn batch;
+    weight_batch_fn fast;
+} weight_batches[] = {
+    {box,       box_batch},
+    {triangle,  triangle_batch},
+    {hann,      hann_batch},
+    {hamming,   hamming_batch},
+    {welch,     welch_batch},
+    {kaiser,    kaiser_batch,   kaiser_fast_batch},
+    {blackman,  blackman_batch},
+    {gaussian,  gaussian_batch},
+    {sinc,      sinc_batch},
+    {jinc,      jinc_batch,     jinc_fast_batch},
+    {sphinx,    sphinx_batch},
+    {bcspline,  bcspline_batch},
+    {bicubic,   bicubic_batch},
+    {spline16,  spline16_batch},
+    {spline36,  spline36_batch},
+    {spline64,  spline64_batch},
+    {0},
+};
+
+static weight_batch_fn find_weight_batch(const struct pl_filter_function *f,
+                                         bool approximate)
+{
+    for (int i = 0; weight_batches[i].weight; i++) {
+        if (weight_batches[i].weight != f->weight)
+            continue;
+        if (approximate && weight_batches[i].fast)
+            return weight_batches[i].fast;
+        return weight_batches[i].batch;
+    }
+
+    return NULL;
+}
+
 // Named filter functions
 const struct pl_named_filter_function pl_named_filter_functions[] = {
     {"box",             &pl_filter_function_box},
@@ -26,6 +26,12 @@
 // noted. That is, multiple pl_context objects are safe to use from multiple
 // threads, but a single pl_context and all of its derived resources and
 // contexts must be used from a single thread at all times.
+//
+// The notable exception is shader generation: pl_shader objects (and
+// pl_filter objects) allocated from the same pl_context may be created and
+// built concurrently from multiple threads, see <libplacebo/shaders.h>. The
+// pl_context itself is safe to log to from any thread, and the log callback
+// is never invoked concurrently.
 struct pl_context;
 
 // The log level associated with a given log message.
@@ -54,6 +60,20 @@ struct pl_context_params {
     // in increased CPU usage as it may enable extra debug paths based on the
     // configured log level.
     enum pl_log_level log_level;
+
+    // The maximum number of filter LUTs (e.g. for pl_shader_sample_polar)
+    // the context keeps around, so that shaders needing the same filter can
+    // share a single LUT instead of regenerating it. When the cache is full,
+    // the least recently used LUT is evicted. (LUTs still in use by shader
+    // objects stay alive regardless) If left as 0, a default of 16 is used.
+    // A negative value disables the cache.
+    int lut_cache_size;
+
+    // If nonzero, large filter LUTs (see pl_filter_generate) are computed
+    // in parallel on this many background threads, shared by everything
+    // allocated from this context. The generated LUTs are identical to the
+    // ones computed serially, only the time taken to generate them changes.
+    int filter_threads;
 };
 
 // Creates a new, blank pl_context. The argument `api_ver` must be given as
@@ -23,17 +23,83 @@
 
 struct pl_dispatch;
 
+struct pl_dispatch_params {
+    // Upper bound on the number of compiled passes retained by the internal
+    // shader cache. Once this is exceeded, the least recently used passes
+    // are evicted. Passes that were used during the current frame (i.e. since
+    // the last call to pl_dispatch_reset_frame) are never evicted, so the
+    // effective number of passes may temporarily exceed this limit. If left
+    // as 0, the number of passes is unlimited.
+    int max_passes;
+
+    // Like `max_passes`, but limits the (estimated) total size in bytes of
+    // all resources associated with the cached passes, including the shader
+    // text, compiled programs and uniform buffers. The estimate does not
+    // account for driver-internal overhead. If left as 0, the size of the
+    // cache is unlimited.
+    size_t max_cache_size;
+
+    // If nonzero, passes are compiled asynchronously on this many background
+    // threads instead of blocking the calling thread. Use
+    // pl_dispatch_finish_fallback to avoid waiting for passes that are still
+    // being compiled. This requires an RA which supports calling
+    // ra_pass_create from other threads. (All built-in RAs do)
+    int compile_threads;
+
+    // If true, the built-in shader operations (pl_shader_deband etc.) cache
+    // their generated GLSL text, keyed by the parameters affecting it. Repeated
+    // calls with the same parameters then skip formatting the text entirely,
+    // which substantially reduces the CPU cost of re-recording the same shaders
+    // every frame. The cached text is only re-used by shaders obtained from
+    // this dispatch object.
+    bool structural_keys;
+
+    // If true, all passes dispatched during a frame (i.e. until the next call
+    // to pl_dispatch_reset_frame) are batched together into as few GPU
+    // submissions as possible, see ra_batch_begin. This reduces the overhead
+    // of frames consisting of many passes, but delays the start of their
+    // execution on the GPU until the end of the frame (or until something
+    // else forces a flush, e.g. ra_flush or downloading a texture).
+    bool batch_passes;
+
+    // If true, the execution of passes rendering to a texture is deferred
+    // until the next call to pl_dispatch_finish. If the next shader samples
+    // that texture directly and pointwise (i.e. using pl_shader_sample_direct
+    // without any cropping or scaling), the deferred shader is inlined into it
+    // and never executed on its own, saving the round trip of the
+    // intermediate texture through memory. Otherwise, the deferred pass gets
+    // executed first, as usual. Compute shaders are never deferred.
+    //
+    // Note: If a pass gets fused, the contents of its target texture remain
+    // undefined. So this should only be enabled if the results of passes are
+    // used exclusively as the input of subsequent passes on the same dispatch
+    // object. Use pl_dispatch_flush to force the execution of a deferred pass
+    // before accessing its target by other means.
+    bool fuse_passes;
+};
+
+// Default parameters. (No limits on the cache size, synchronous compilation)
+extern const struct pl_dispatch_params pl_dispatch_default_params;
+
 // Creates a new shader dispatch object. This object provides a translation
 // layer between generated shaders (pl_shader) and the ra context such that it
 // can be used to execute shaders. This dispatch object will also provide
-// shader caching (for efficient re-use).
-struct pl_dispatch *pl_dispatch_create(struct pl_context *ctx, const struct ra *ra);
+// shader caching (for efficient re-use). If `params` is left as NULL, it
+// defaults to &pl_dispatch_default_params.
+struct pl_dispatch *pl_dispatch_create(struct pl_context *ctx, const struct ra *ra,
+                                       const struct pl_dispatch_params *params);
 void pl_dispatch_destroy(struct pl_dispatch **dp);
 
 // Returns a blank pl_shader object, suitable for recording rendering commands.
 // For more information, see the header documentation in `shaders/*.h`. The
 // generated shaders always have unique identifiers, and can therefore be
-// safely merged together.
+// safely merged together. (See pl_shader_subpass)
+//
+// Like the rest of the pl_dispatch API, this must be called from the thread
+// using the RA. The returned shader may be built on any thread, however,
+// unless `pl_dispatch_params.fuse_passes` is enabled. Shaders allocated with
+// pl_shader_alloc (e.g. by worker threads) can also be passed to
+// pl_dispatch_finish, which takes over ownership of them.
 struct pl_shader *pl_dispatch_begin(struct pl_dispatch *dp);
 
 // Dispatch a generated shader (via the pl_shader mechanism). The results of
@@ -43,6 +109,86 @@ struct pl_shader *pl_dispatch_begin(struct pl_dispatch *dp);
 bool pl_dispatch_finish(struct pl_dispatch *dp, struct pl_shader *sh,
                         const struct ra_tex *target);
 
+// Like pl_dispatch_finish, but if the pass corresponding to `sh` is still
+// being compiled in the background (see `pl_dispatch_params.compile_threads`),
+// `fallback` gets dispatched to `target` instead. The fallback is typically a
+// cheaper or lower quality version of the same shader, ideally one whose pass
+// is already compiled. (Otherwise, this will block on the fallback instead)
+// Ownership of both shaders is taken over by this function, regardless of
+// which one ends up being used. `fallback` may be NULL, in which case this is
+// equivalent to pl_dispatch_finish, i.e. it waits for the compilation to
+// complete.
+bool pl_dispatch_finish_fallback(struct pl_dispatch *dp, struct pl_shader *sh,
+                                 struct pl_shader *fallback,
+                                 const struct ra_tex *target);
+
+// Executes the currently deferred pass, if any. (See
+// `pl_dispatch_params.fuse_passes`) This also happens implicitly as part of
+// pl_dispatch_reset_frame and pl_dispatch_destroy. Returns false if executing
+// the deferred pass failed.
+bool pl_dispatch_flush(struct pl_dispatch *dp);
+
+// Creates the pass corresponding to `sh` (as it would be created by
+// pl_dispatch_finish with a target described by `target_params`) without
+// running anything, so that later dispatches of the same shader don't have to
+// wait for it to compile. Only the format and usage flags of `target_params`
+// affect the created pass. The size must merely be compatible with the
+// shader's output size, if it has one. Like pl_dispatch_finish, this takes
+// over ownership of `sh`. Returns false if the pass could not be created.
+//
+// Note that the shader's identifier (see pl_dispatch_begin) is part of the
+// cached pass, so the precompiled shader should be obtained from the same
+// position within a frame as the shader it's meant to speed up.
+//
+// If `pl_dispatch_params.compile_threads` is set, this does not block. The
+// compilation of many passes can thus happen in parallel.
+bool pl_dispatch_precompile(struct pl_dispatch *dp, struct pl_shader *sh,
+                            const struct ra_tex_params *target_params);
+
+struct pl_dispatch_compile_stats {
+    int num_compiled;    // number of passes created so far (including failed)
+    int num_pending;     // number of passes currently compiling in the background
+    uint64_t compile_ns; // total time spent in pass creation, on all threads
+    uint64_t stall_ns;   // time the calling thread was blocked on pass creation
+};
+
+// Retrieves the pass compilation statistics. This can be used to measure the
+// amount of time spent stalling on shader compilation.
+void pl_dispatch_compile_stats(struct pl_dispatch *dp,
+                               struct pl_dispatch_compile_stats *out);
+
+// Timing measurements of a single pass, in nanoseconds
+struct pl_dispatch_timing {
+    int count;        // number of measurements taken so far
+    uint64_t last;    // most recent measurement
+    uint64_t peak;    // highest measurement
+    uint64_t average; // mean of all measurements
+};
+
+struct pl_dispatch_pass_stats {
+    // The pl_shader_signature of the shader this pass was created from. Note
+    // that dispatching the same shader to targets with different formats
+    // results in multiple passes, with the same signature.
+    uint64_t signature;
+
+    // Time spent on the CPU inside pl_dispatch_finish, including updating
+    // the pass's variables and recording the commands, but excluding the
+    // creation of the pass itself.
+    struct pl_dispatch_timing cpu;
+
+    // Time spent executing the pass on the GPU. These measurements become
+    // available asynchronously, and only if the RA supports timer queries
+    // (see ra_timer_create). Otherwise, `gpu.count` remains 0.
+    struct pl_dispatch_timing gpu;
+};
+
+// Retrieves the timing statistics of the passes currently cached by this
+// dispatch object. Fills in at most `num` entries of `out`, and returns the
+// total number of passes. (So calling this with `num` = 0 can be used to
+// query the required size) Statistics are lost when passes get evicted.
+int pl_dispatch_stats(struct pl_dispatch *dp, struct pl_dispatch_pass_stats *out,
+                      int num);
+
 // Cancel an active shader without submitting anything. Useful, for example,
 // if the shader was instead merged into a different shader.
 void pl_dispatch_abort(struct pl_dispatch *dp, struct pl_shader *sh);
@@ -51,7 +197,28 @@ void pl_dispatch_abort(struct pl_dispatch *dp, struct pl_shader *sh);
 // whenever the user is going to begin with a new frame, in order to ensure
 // that the "same" calls to pl_dispatch_begin end up creating shaders with
 // the same identifier. Failing to follow this rule means shader caching will
-// not work correctly.
+// not work correctly. This is also the point at which unused passes get
+// evicted from the cache, if the cache size is limited.
 void pl_dispatch_reset_frame(struct pl_dispatch *dp);
 
+// Serializes the compiled programs of all passes known to this dispatch
+// object into an opaque binary blob, which can be e.g. written to disk and
+// loaded again in a future process using pl_dispatch_load, allowing passes to
+// skip the (expensive) shader compilation. If `out` is NULL, nothing is written
+// and this function only returns the number of bytes required. Otherwise,
+// `out` must point to a buffer of at least this size. Returns the number of
+// bytes written.
+//
+// Note: Only passes whose underlying RA supports cached programs (see
+// `ra_pass_params.cached_program`) produce entries in the cache.
+size_t pl_dispatch_save(struct pl_dispatch *dp, uint8_t *out);
+
+// Loads a cache previously generated by pl_dispatch_save. The programs are
+// keyed by shader signature and only get used once a pass with a matching
+// signature is created. Caches generated by a different version of libplacebo
+// or for a differently configured RA are ignored. Returns whether the cache
+// was successfully loaded. This can be called multiple times, in which case
+// entries already known to this dispatch object take precedence.
+bool pl_dispatch_load(struct pl_dispatch *dp, const uint8_t *cache, size_t size);
+
 #endif // LIBPLACEBO_DISPATCH_H
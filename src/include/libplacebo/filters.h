@@ -221,6 +221,13 @@ extern const struct pl_named_filter_config pl_named_filters[];
 // on name = NULL.
 const struct pl_named_filter_config *pl_find_named_filter(const char *name);
 
+// The encoding of the values in `pl_filter.lut`
+enum pl_filter_lut_type {
+    PL_FILTER_LUT_FLOAT = 0, // 32-bit float, identical to `pl_filter.weights`
+    PL_FILTER_LUT_HALF,      // 16-bit (IEEE 754) half float
+    PL_FILTER_LUT_SNORM16,   // 16-bit signed normalized fixed point
+};
+
 // Parameters for filter generation.
 struct pl_filter_params {
     // The particular filter configuration to be sampled. config.kernel must
@@ -229,15 +236,41 @@ struct pl_filter_params {
 
     // The precision of the resulting LUT. A value of 64 should be fine for
     // most practical purposes, but higher or lower values may be justified
-    // depending on the use case. This value must be set to something > 0.
+    // depending on the use case. This value must be set to something > 0,
+    // unless `max_error` is set.
     int lut_entries;
 
+    // If set to a value > 0, the LUT size is chosen automatically: the
+    // smallest number of entries (up to `lut_entries`, or 1024 if that is
+    // left as 0) is picked such that linearly interpolating between adjacent
+    // entries deviates from sampling the filter directly (as with
+    // pl_filter_sample) by no more than this value. Smooth filters get by
+    // with far fewer entries than sharp ones. The chosen size is returned in
+    // `pl_filter.params.lut_entries`, and the achieved error in
+    // `pl_filter.lut_error`.
+    float max_error;
+
     // When set to values above 1.0, the filter will be computed at a size
     // larger than the radius would otherwise require, in order to prevent
     // aliasing when downscaling. In practice, this should be set to the
     // inverse of the scaling ratio, i.e. src_size / dst_size.
     float filter_scale;
 
+    // If true, filter functions which are expensive to evaluate exactly
+    // (currently jinc and kaiser) are replaced by polynomial approximations.
+    // Their error is far below the precision of the (single precision) LUT,
+    // but they're several times faster to evaluate, which matters for large
+    // values of `lut_entries`.
+    bool approximate;
+
+    // The encoding of the generated `pl_filter.lut`. The compact types halve
+    // the size of the LUT (and thus its footprint in the texture cache when
+    // sampling from it), at the cost of precision. Half floats are rounded
+    // to nearest (ties to even). For PL_FILTER_LUT_SNORM16, the weights of
+    // each row of a separable filter are re-normalized after quantization,
+    // so that they still sum up to exactly 1.0.
+    enum pl_filter_lut_type lut_type;
+
     // --- polar filers only (config.polar)
 
     // As a micro-optimization, all samples below this cutoff value will be
@@ -256,13 +289,21 @@ struct pl_filter_params {
     // each row. The chosen row_size will always be a multiple of this value.
     // Specifying 0 indicates no alignment requirements.
     int row_stride_align;
+
+    // If true, the LUT is meant to be uploaded as a texture with 4 taps
+    // packed into each (RGBA) texel, which quarters the number of texture
+    // fetches required per row. This only affects the alignment of the rows:
+    // the row stride will always be a multiple of 4 (in addition to
+    // `row_stride_align`), so that every row starts on a texel boundary.
+    bool pack_rgba;
 };
 
 // Represents an initialized instance of a particular filter, with a
 // precomputed LUT. The interpretation of the LUT depends on the type of the
 // filter (polar or separable).
 struct pl_filter {
-    // Deep copy of the parameters, for convenience.
+    // Deep copy of the parameters, for convenience. If `max_error` was set,
+    // `lut_entries` is replaced by the chosen LUT size.
     struct pl_filter_params params;
 
     // Contains the true radius of the computed filter. This may be
@@ -284,6 +325,21 @@ struct pl_filter {
     // of phase), you would use the values from weights[lut_entries/2].
     const float *weights;
 
+    // The same LUT as `weights`, with the same layout, but encoded as
+    // described by `params.lut_type`. This is what should be uploaded to
+    // the GPU. `lut_size` is the total size in bytes. For the compact LUT
+    // types, `weights` contains the decoded (i.e. quantized) values, so that
+    // the two always agree with each other.
+    const void *lut;
+    size_t lut_size;
+
+    // If `params.max_error` was set, this contains the maximum error of
+    // linearly interpolating between adjacent LUT entries, measured on the
+    // final (possibly quantized, see `params.lut_type`) `weights`. This may
+    // exceed `params.max_error` if the bound could not be reached within
+    // the maximum LUT size, or due to the quantization. Otherwise, it's 0.
+    float lut_error;
+
     // --- polar filters only (params.config.polar)
 
     // Contains the effective cut-off radius for this filter. Samples outside
@@ -302,16 +358,17 @@ struct pl_filter {
     bool insufficient;
 
     // The separation (in *weights) between each row of the filter. Always
-    // a multiple of params.row_stride_align.
+    // a multiple of params.row_stride_align (and of 4, if params.pack_rgba
+    // is set).
     int row_stride;
 };
 
 // Generate (compute) a filter instance based on a given filter configuration.
 // The resulting pl_filter must be freed with `pl_filter_free` when no longer
 // needed. Returns NULL if filter generation fails due to invalid parameters
-// (i.e. missing a required parameter).
-// The resulting pl_filter is implicitly destroyed when the pl_context is
-// destroyed.
+// (i.e. missing a required parameter). The `ctx` is only used for logging and
+// for its filter threads (see `pl_context_params.filter_threads`), so this may
+// be called concurrently from multiple threads.
 const struct pl_filter *pl_filter_generate(struct pl_context *ctx,
                                        const struct pl_filter_params *params);
 
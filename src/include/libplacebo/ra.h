@@ -47,6 +47,7 @@ enum {
     RA_CAP_COMPUTE          = 1 << 0, // supports compute shaders
     RA_CAP_PARALLEL_COMPUTE = 1 << 1, // supports multiple compute queues
     RA_CAP_INPUT_VARIABLES  = 1 << 2, // supports shader input variables
+    RA_CAP_SPEC_CONSTANTS   = 1 << 3, // supports specialization constants
 };
 
 // Structure defining the physical limits of this RA instance. If a limit is
@@ -617,6 +618,19 @@ enum ra_pass_type {
     RA_PASS_TYPE_COUNT,
 };
 
+// Represents a specialization constant. These are declared in the shader as
+// `layout(constant_id=N) const type name = default;` (with N given by `id`),
+// and get their actual values assigned at pass creation time. Since the
+// shader text is independent of the values, the same compiled program can be
+// used for every set of values, while the driver can still constant-fold
+// them when creating the pass. Only scalar types are supported, and every
+// constant occupies ra_var_type_size(type) bytes of `constant_data`.
+struct ra_constant {
+    enum ra_var_type type; // type of the constant (not RA_VAR_INVALID)
+    int id;                // the `constant_id` as used in the shader
+    size_t offset;         // byte offset of the value in `constant_data`
+};
+
 // Description of a rendering pass. It conflates the following:
 //  - GLSL shader(s) and its list of inputs
 //  - target parameters (for raster passes)
@@ -635,6 +649,14 @@ struct ra_pass_params {
     // Push constant region. Must be be a multiple of 4 <= limits.max_pushc_size
     size_t push_constants_size;
 
+    // Specialization constants. Only supported if RA_CAP_SPEC_CONSTANTS is
+    // set. Otherwise, num_constants must be 0. The values are read from
+    // `constant_data` at the offsets given by each constant, and are fixed
+    // for the lifetime of the pass.
+    struct ra_constant *constants;
+    int num_constants;
+    const void *constant_data;
+
     // The shader text in GLSL. For RA_PASS_RASTER, this is interpreted
     // as a fragment shader. For RA_PASS_COMPUTE, this is interpreted as
     // a compute shader.
@@ -704,6 +726,11 @@ struct ra_pass {
 // operation and may take a significant amount of time, even if a cached
 // program is used. Returns NULL on failure.
 //
+// Unlike most other ra_* functions, this may be called from any thread, and
+// concurrently with other calls on the same RA (including itself). RA
+// implementations must make sure this is safe. Note that `target_dummy.priv`
+// may be NULL in this case.
+//
 // The resulting ra_pass->params.cached_program will be initialized by
 // this function to point to a new, valid cached program (if any).
 const struct ra_pass *ra_pass_create(const struct ra *ra,
@@ -711,6 +738,25 @@ const struct ra_pass *ra_pass_create(const struct ra *ra,
 
 void ra_pass_destroy(const struct ra *ra, const struct ra_pass **pass);
 
+// Timer objects, used to measure the GPU execution time of render passes.
+// The contents are RA-specific.
+struct ra_timer;
+
+// Creates a new timer object. Returns NULL if the RA does not support timer
+// queries. (This is not an error)
+struct ra_timer *ra_timer_create(const struct ra *ra);
+void ra_timer_destroy(const struct ra *ra, struct ra_timer **timer);
+
+// Returns the GPU execution time (in nanoseconds) of one of the previous
+// ra_pass_run invocations this timer was attached to, or 0 if no further
+// results are available yet. Results become available asynchronously, some
+// time after the GPU has finished executing the pass, and are returned in the
+// order the passes were run. To retrieve all available results, call this in
+// a loop until it returns 0. RAs may only keep track of a limited number of
+// outstanding measurements per timer, so invocations run while too many
+// results are still unqueried may not get measured at all.
+uint64_t ra_timer_query(const struct ra *ra, struct ra_timer *timer);
+
 struct ra_desc_binding {
     const void *object; // ra_* object with type corresponding to ra_desc_type
 };
@@ -738,6 +784,10 @@ struct ra_pass_run_params {
     // fully defined for every invocation if params.push_constants_size > 0.
     void *push_constants;
 
+    // If set, the GPU execution time of this invocation is measured by this
+    // timer. (See ra_timer_query)
+    struct ra_timer *timer;
+
     // --- pass->params.type==RA_PASS_RASTER only
 
     // Target must be a 2D texture, target->params.renderable must be true, and
@@ -778,4 +828,15 @@ void ra_pass_run(const struct ra *ra, const struct ra_pass_run_params *params);
 // results (via ra_tex_download) at the very end.
 void ra_flush(const struct ra *ra);
 
+// Hints that the render passes run until the matching ra_batch_end should be
+// submitted to the GPU together, rather than individually. Like ra_flush, this
+// is semantically a no-op; RAs may ignore it, and may still flush commands in
+// the middle of a batch whenever necessary. Batches may be nested, in which
+// case only the outermost ra_batch_end takes effect.
+//
+// Batching reduces the CPU and driver overhead of executing many small passes
+// per frame, at the cost of the GPU starting to execute them later.
+void ra_batch_begin(const struct ra *ra);
+void ra_batch_end(const struct ra *ra);
+
 #endif // LIBPLACEBO_RA_H_
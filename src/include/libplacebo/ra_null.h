@@ -0,0 +1,81 @@
+/*
+ * This file is part of libplacebo.
+ *
+ * libplacebo is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libplacebo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libplacebo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBPLACEBO_RA_NULL_H_
+#define LIBPLACEBO_RA_NULL_H_
+
+#include "ra.h"
+
+// The null RA implements the full RA API, but never touches a GPU and never
+// executes anything. All objects can be created and used as usual (and the
+// usual validity checks apply), but texture contents are not stored and
+// passes don't render anything. Texture downloads return zeros. Buffers are
+// backed by host memory and preserve their contents.
+//
+// This is useful for measuring the CPU overhead of shader generation and
+// dispatch, and for testing code built on top of RA on machines without a
+// GPU.
+
+struct ra_null_params {
+    // The capabilities and GLSL dialect to advertise. Shaders get generated
+    // the same way as they would for a real RA with these properties.
+    ra_caps caps;
+    struct ra_glsl_desc glsl;
+
+    // The limits to advertise. If left as NULL, reasonable defaults (loosely
+    // modelled after a typical desktop GPU) are used.
+    const struct ra_limits *limits;
+
+    // If true, every call to ra_pass_run is recorded into a command log,
+    // which can be inspected with ra_null_commands.
+    bool record_commands;
+};
+
+// Default parameters: GLSL 450 with vulkan semantics, compute shaders and
+// specialization constants supported, no command recording.
+extern const struct ra_null_params ra_null_default_params;
+
+// Creates a new null RA. If `params` is left as NULL, it defaults to
+// &ra_null_default_params.
+const struct ra *ra_null_create(struct pl_context *ctx,
+                                const struct ra_null_params *params);
+
+// All resources allocated from this RA must be destroyed by the user before
+// calling ra_null_destroy.
+void ra_null_destroy(const struct ra **ra);
+
+// A single recorded invocation of ra_pass_run. The contents mirror the
+// corresponding ra_pass_run_params, except that `desc_bindings` and
+// `push_constants` are copies, owned by the command log.
+struct ra_null_cmd {
+    const struct ra_pass *pass; // may dangle if the pass was destroyed since
+    const struct ra_tex *target;
+    const struct ra_desc_binding *desc_bindings;
+    const void *push_constants;
+    int num_var_updates;
+    int vertex_count;
+    int compute_groups[3];
+};
+
+// Returns the commands recorded since the RA was created (or since the last
+// call to ra_null_clear_commands), in order. The number of commands is
+// returned in `*num`. The returned array remains valid until the next call
+// to ra_pass_run or ra_null_clear_commands. `ra` must be a null RA.
+const struct ra_null_cmd *ra_null_commands(const struct ra *ra, int *num);
+void ra_null_clear_commands(const struct ra *ra);
+
+#endif // LIBPLACEBO_RA_NULL_H_
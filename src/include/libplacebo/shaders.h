@@ -23,13 +23,23 @@
 // but wishes to include functions generated by libplacebo as part of their
 // own rendering process. This API is normally not used for operation with
 // libplacebo's higher-level constructs such as `pl_dispatch` or `pl_renderer`.
+//
+// Note on thread safety: Different pl_shader objects may be built from
+// different threads at the same time, even if they share the same pl_context
+// and `ra`, as long as every pl_shader and pl_shader_obj is only used by one
+// thread at a time. Shader builders don't call into the `ra` themselves:
+// resources which need it (such as LUT textures) are only created by
+// pl_shader_finalize (or by pl_dispatch), and released by pl_shader_reset,
+// pl_shader_free or pl_shader_obj_destroy. Those functions must therefore
+// only be called from the thread using the `ra`. The only exception is
+// pl_shader_detect_peak, which creates its buffer immediately.
 
 #include "ra.h"
 
 struct pl_shader;
 
-// Creates a new, blank, mutable pl_shader object. The resulting pl_shader s
-// implicitly destroyed when the pl_context is destroyed.
+// Creates a new, blank, mutable pl_shader object. The resulting pl_shader
+// must be freed with pl_shader_free when no longer needed.
 //
 // If `ra` is non-NULL, then this `ra` will be used to create objects such as
 // textures and buffers, or check for required capabilities, for operations
@@ -72,10 +82,28 @@ bool pl_shader_output_size(const struct pl_shader *sh, int *w, int *h);
 // Compatibility in this context means that they differ only in the contents
 // of variables, vertex attributes or descriptor bindings. The structure,
 // shader text and number/names of input variables/descriptors/attributes must
-// be the same. Note that computing this function takes some time, so the
-// results should be re-used where possible.
+// be the same. The signature is maintained incrementally while the shader is
+// being built, so computing this function is cheap.
 uint64_t pl_shader_signature(const struct pl_shader *sh);
 
+// A rough, static estimate of the cost of running a shader, per invocation
+// (i.e. per output pixel), as recorded by the shader builders. This ignores
+// the actual GPU, and is only meant for comparing the relative cost of shaders
+// (e.g. to pick a filter quality which fits into a time budget). Operations
+// are counted as they appear in the shader, so e.g. a pow() on a vec3 counts
+// as three transcendental operations.
+struct pl_shader_cost {
+    int tex_fetches;     // number of texture samples (not including gathers)
+    int tex_gathers;     // number of texture gathers
+    int transcendentals; // number of scalar pow/exp/log/sqrt/sin/cos etc.
+    size_t shmem;        // shared memory per work group (compute shaders only)
+    int registers;       // register pressure hint: peak number of live vec4s
+};
+
+// Returns the estimated cost of the operations recorded into the shader so
+// far. This may also be called on finalized shaders.
+struct pl_shader_cost pl_shader_get_cost(const struct pl_shader *sh);
+
 // Indicates the type of signature that is associated with a shader result.
 // Every shader result defines a function that may be called by the user, and
 // this enum indicates the type of value that this function takes and/or
@@ -121,6 +149,17 @@ struct pl_shader_res {
     // A list of input descriptors needed by this shader fragment,
     struct pl_shader_desc *descriptors;
     int num_descriptors;
+
+    // The estimated cost of this shader fragment, see pl_shader_get_cost.
+    struct pl_shader_cost cost;
+
+    // A list of specialization constants needed by this shader fragment. The
+    // user must declare these (e.g. as `layout(constant_id=N) const`) and
+    // assign their values. This is only ever non-empty if the shader's RA
+    // supports RA_CAP_SPEC_CONSTANTS. Otherwise, the values are inlined into
+    // the shader text by pl_shader_finalize.
+    struct pl_shader_const *constants;
+    int num_constants;
 };
 
 // Represents a vertex attribute. The four values will be bound to the four
@@ -144,13 +183,37 @@ struct pl_shader_desc {
     const void *object;  // the object being bound (as for ra_desc_binding)
 };
 
+// Represents a scalar value which is constant for the lifetime of the shader,
+// but which should not be part of the shader text (e.g. filter parameters)
+struct pl_shader_const {
+    enum ra_var_type type;
+    const char *name;
+    const void *data; // the raw value (a single int, unsigned int or float)
+};
+
+// Merges `sub` into `sh`, as if the operations recorded into `sub` had been
+// performed on `sh` directly. The text of `sub` becomes a function of `sh`,
+// which gets called on the current color (if `sub` has an input signature of
+// PL_SHADER_SIG_COLOR) or whose result becomes the current color (for
+// PL_SHADER_SIG_NONE). The usual signature and output size requirements
+// apply, as do the compute shader requirements of `sub`. All of the
+// variables, descriptors and vertex attributes of `sub` are copied over.
+//
+// `sub` must not be finalized, and must have been created with a different
+// `ident` than `sh`. It is not modified by this function, and may be freely
+// reset or freed afterwards. (e.g. using pl_dispatch_abort) Returns false if
+// the shaders could not be merged, in which case `sh` is left unchanged.
+bool pl_shader_subpass(struct pl_shader *sh, const struct pl_shader *sub);
+
 // Finalize a pl_shader. It is no longer mutable at this point, and any further
 // attempts to modify it result in an error. (Functions which take a const
 // struct pl_shader * argument do not modify the shader and may be freely
 // called on an already-finalized shader)
 //
 // The returned pl_shader_res is bound to the lifetime of the pl_shader - and
-// will only remain valid until the pl_shader is freed or reset.
+// will only remain valid until the pl_shader is freed or reset. Returns NULL
+// if the GPU resources needed by the shader (e.g. LUT textures) could not be
+// created.
 const struct pl_shader_res *pl_shader_finalize(struct pl_shader *sh);
 
 // Shader objects represent abstract resources that shaders need to manage in
@@ -97,8 +97,13 @@ struct pl_sample_polar_params {
     struct pl_filter_config filter;
     // The precision of the polar LUT. Defaults to 64 if unspecified.
     int lut_entries;
+    // See `pl_filter_params.max_error`. If set, the LUT size is picked
+    // automatically, and `lut_entries` (if specified) only limits it.
+    float max_error;
     // See `pl_filter_params.cutoff`. Defaults to 0.001 if unspecified.
     float cutoff;
+    // See `pl_filter_params.lut_type`. Defaults to PL_FILTER_LUT_FLOAT.
+    enum pl_filter_lut_type lut_type;
 
     // This shader object is used to store the LUT, and will be recreated
     // if necessary. To avoid thrashing the resource, users should avoid trying
@@ -18,6 +18,7 @@
 #include "common.h"
 #include "context.h"
 #include "ra.h"
+#include "shaders.h"
 
 int ra_optimal_transfer_stride(const struct ra *ra, int dimension)
 {
@@ -29,6 +30,8 @@ void ra_destroy(const struct ra *ra)
     if (!ra)
         return;
 
+    // The context outlives the RA, so drop the LUTs cached for it
+    sh_lut_cache_flush(ra->ctx->lut_cache, ra);
     ra->impl->destroy(ra);
 }
 
@@ -796,6 +799,14 @@ const struct ra_pass *ra_pass_create(const struct ra *ra,
         // TODO: enforce disjoint bindings if possible?
     }
 
+    for (int i = 0; i < params->num_constants; i++) {
+        assert(ra->caps & RA_CAP_SPEC_CONSTANTS);
+        struct ra_constant sc = params->constants[i];
+        assert(sc.type > RA_VAR_INVALID && sc.type < RA_VAR_TYPE_COUNT);
+        assert(sc.id >= 0);
+        assert(params->constant_data);
+    }
+
     assert(params->push_constants_size <= ra->limits.max_pushc_size);
     assert(params->push_constants_size == PL_ALIGN2(params->push_constants_size, 4));
 
@@ -811,6 +822,31 @@ void ra_pass_destroy(const struct ra *ra, const struct ra_pass **pass)
     *pass = NULL;
 }
 
+struct ra_timer *ra_timer_create(const struct ra *ra)
+{
+    if (!ra->impl->timer_create)
+        return NULL;
+
+    return ra->impl->timer_create(ra);
+}
+
+void ra_timer_destroy(const struct ra *ra, struct ra_timer **timer)
+{
+    if (!*timer)
+        return;
+
+    ra->impl->timer_destroy(ra, *timer);
+    *timer = NULL;
+}
+
+uint64_t ra_timer_query(const struct ra *ra, struct ra_timer *timer)
+{
+    if (!timer)
+        return 0;
+
+    return ra->impl->timer_query(ra, timer);
+}
+
 static bool ra_tex_params_compat(const struct ra_tex_params a,
                                 const struct ra_tex_params b)
 {
@@ -929,6 +965,18 @@ void ra_flush(const struct ra *ra)
         ra->impl->flush(ra);
 }
 
+void ra_batch_begin(const struct ra *ra)
+{
+    if (ra->impl->batch_begin)
+        ra->impl->batch_begin(ra);
+}
+
+void ra_batch_end(const struct ra *ra)
+{
+    if (ra->impl->batch_end)
+        ra->impl->batch_end(ra);
+}
+
 // RA-internal helpers
 
 struct ra_var_layout std140_layout(const struct ra *ra, size_t offset,
@@ -1112,6 +1160,16 @@ struct ra_pass_params ra_pass_params_copy(void *tactx,
     DUPSTRS(name, new.descriptors,    new.num_descriptors);
     DUPSTRS(name, new.vertex_attribs, new.num_vertex_attribs);
 
+    size_t data_size = 0;
+    for (int i = 0; i < new.num_constants; i++) {
+        const struct ra_constant *sc = &new.constants[i];
+        data_size = PL_MAX(data_size, sc->offset + ra_var_type_size(sc->type));
+    }
+
+    new.constants = TARRAY_DUP(tactx, new.constants, new.num_constants);
+    new.constant_data = data_size ? talloc_memdup(tactx, new.constant_data,
+                                                  data_size) : NULL;
+
     for (int i = 0; i < new.num_descriptors; i++) {
         struct ra_desc *desc = &new.descriptors[i];
         DUPSTRS(var.name, desc->buffer_vars, desc->num_buffer_vars);
@@ -28,6 +28,7 @@ struct ra_fns {
     void (*tex_destroy)(const struct ra *, const struct ra_tex *);
     void (*buf_destroy)(const struct ra *, const struct ra_buf *);
     void (*pass_destroy)(const struct ra *, const struct ra_pass *);
+    void (*timer_destroy)(const struct ra *, const struct ra_timer *);
 
     RA_PFN(tex_create);
     RA_PFN(tex_invalidate);
@@ -43,6 +44,10 @@ struct ra_fns {
     RA_PFN(pass_create);
     RA_PFN(pass_run);
     RA_PFN(flush); // optional
+    RA_PFN(batch_begin); // optional
+    RA_PFN(batch_end); // optional
+    RA_PFN(timer_create); // optional: if NULL, timers are not supported
+    RA_PFN(timer_query);
 
     // The following functions are optional if the corresponding ra_limit
     // size restriction is 0
@@ -0,0 +1,349 @@
+/*
+ * This file is part of libplacebo.
+ *
+ * libplacebo is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libplacebo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libplacebo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "common.h"
+#include "context.h"
+#include "ra.h"
+
+static const struct ra_fns ra_fns_null;
+
+const struct ra_null_params ra_null_default_params = {
+    .caps = RA_CAP_COMPUTE | RA_CAP_SPEC_CONSTANTS,
+    .glsl = {
+        .version = 450,
+        .vulkan  = true,
+    },
+};
+
+static const struct ra_limits null_default_limits = {
+    .max_tex_1d_dim    = 16384,
+    .max_tex_2d_dim    = 16384,
+    .max_tex_3d_dim    = 2048,
+    .max_pushc_size    = 128,
+    .max_xfer_size     = SIZE_MAX,
+    .max_ubo_size      = 65536,
+    .max_ssbo_size     = 1 << 27,
+    .min_gather_offset = -8,
+    .max_gather_offset = 7,
+    .max_shmem_size    = 32768,
+    .max_group_threads = 1024,
+    .max_group_size    = {1024, 1024, 64},
+    .max_dispatch      = {65535, 65535, 65535},
+    .align_tex_xfer_stride = 1,
+    .align_tex_xfer_offset = 32,
+};
+
+// For ra.priv
+struct ra_null {
+    bool record;
+    void *log_ctx; // talloc context for the recorded data
+    struct ra_null_cmd *cmds;
+    int num_cmds;
+};
+
+#define CAPS_BASIC (RA_FMT_CAP_SAMPLEABLE | RA_FMT_CAP_BLITTABLE)
+#define CAPS_FLOAT (CAPS_BASIC | RA_FMT_CAP_LINEAR | RA_FMT_CAP_RENDERABLE | \
+                    RA_FMT_CAP_BLENDABLE | RA_FMT_CAP_STORABLE)
+#define CAPS_INT   (CAPS_BASIC | RA_FMT_CAP_RENDERABLE | RA_FMT_CAP_STORABLE)
+
+#define REGFMT(_name, num, bits, ftype, _caps)  \
+    {                                           \
+        .name = _name,                          \
+        .type = RA_FMT_##ftype,                 \
+        .caps = _caps,                          \
+        .num_components  = num,                 \
+        .component_index = {0, 1, 2, 3},        \
+        .component_depth = {bits, bits, bits, bits}, \
+        .texel_size      = (num) * (bits) / 8,  \
+    }
+
+static const struct ra_fmt null_formats[] = {
+    REGFMT("r8",       1,  8, UNORM, CAPS_FLOAT),
+    REGFMT("rg8",      2,  8, UNORM, CAPS_FLOAT),
+    REGFMT("rgb8",     3,  8, UNORM, CAPS_BASIC | RA_FMT_CAP_LINEAR),
+    REGFMT("rgba8",    4,  8, UNORM, CAPS_FLOAT),
+    REGFMT("r16",      1, 16, UNORM, CAPS_FLOAT),
+    REGFMT("rg16",     2, 16, UNORM, CAPS_FLOAT),
+    REGFMT("rgb16",    3, 16, UNORM, CAPS_BASIC | RA_FMT_CAP_LINEAR),
+    REGFMT("rgba16",   4, 16, UNORM, CAPS_FLOAT),
+    REGFMT("r16s",     1, 16, SNORM, CAPS_BASIC | RA_FMT_CAP_LINEAR),
+    REGFMT("rgba16s",  4, 16, SNORM, CAPS_BASIC | RA_FMT_CAP_LINEAR),
+    REGFMT("r16hf",    1, 16, FLOAT, CAPS_FLOAT),
+    REGFMT("rg16hf",   2, 16, FLOAT, CAPS_FLOAT),
+    REGFMT("rgba16hf", 4, 16, FLOAT, CAPS_FLOAT),
+    REGFMT("r32f",     1, 32, FLOAT, CAPS_FLOAT | RA_FMT_CAP_VERTEX),
+    REGFMT("rg32f",    2, 32, FLOAT, CAPS_FLOAT | RA_FMT_CAP_VERTEX),
+    REGFMT("rgb32f",   3, 32, FLOAT, CAPS_BASIC | RA_FMT_CAP_LINEAR |
+                                     RA_FMT_CAP_VERTEX),
+    REGFMT("rgba32f",  4, 32, FLOAT, CAPS_FLOAT | RA_FMT_CAP_VERTEX),
+    REGFMT("r8u",      1,  8, UINT,  CAPS_INT),
+    REGFMT("rgba8u",   4,  8, UINT,  CAPS_INT),
+    REGFMT("r32u",     1, 32, UINT,  CAPS_INT),
+};
+
+static void null_setup_formats(struct ra *ra)
+{
+    for (int i = 0; i < PL_ARRAY_SIZE(null_formats); i++) {
+        struct ra_fmt *fmt = talloc_ptrtype(ra, fmt);
+        *fmt = null_formats[i];
+
+        for (int c = fmt->num_components; c < 4; c++)
+            fmt->component_index[c] = fmt->component_depth[c] = 0;
+
+        if (!(ra->caps & RA_CAP_COMPUTE))
+            fmt->caps &= ~RA_FMT_CAP_STORABLE;
+
+        if (fmt->caps & RA_FMT_CAP_VERTEX) {
+            fmt->glsl_type = ra_var_glsl_type_name(ra_var_from_fmt(fmt, ""));
+            assert(fmt->glsl_type);
+        }
+
+        if (fmt->caps & RA_FMT_CAP_STORABLE) {
+            fmt->glsl_format = ra_fmt_glsl_format(fmt);
+            if (!fmt->glsl_format)
+                fmt->caps &= ~RA_FMT_CAP_STORABLE;
+        }
+
+        TARRAY_APPEND(ra, ra->formats, ra->num_formats, fmt);
+    }
+
+    ra_sort_formats(ra);
+    ra_print_formats(ra, PL_LOG_DEBUG);
+}
+
+const struct ra *ra_null_create(struct pl_context *ctx,
+                                const struct ra_null_params *params)
+{
+    params = PL_DEF(params, &ra_null_default_params);
+
+    struct ra *ra = talloc_zero(NULL, struct ra);
+    ra->ctx = ctx;
+    ra->impl = &ra_fns_null;
+    ra->caps = params->caps;
+    ra->glsl = params->glsl;
+    ra->limits = *PL_DEF(params->limits, &null_default_limits);
+
+    if (!(ra->caps & RA_CAP_COMPUTE)) {
+        ra->limits.max_shmem_size = 0;
+        ra->limits.max_group_threads = 0;
+        for (int i = 0; i < 3; i++)
+            ra->limits.max_group_size[i] = ra->limits.max_dispatch[i] = 0;
+    }
+
+    struct ra_null *p = ra->priv = talloc_zero(ra, struct ra_null);
+    p->record = params->record_commands;
+    p->log_ctx = talloc_new(p);
+
+    null_setup_formats(ra);
+    return ra;
+}
+
+static void null_destroy(const struct ra *ra)
+{
+    talloc_free((void *) ra);
+}
+
+void ra_null_destroy(const struct ra **ra)
+{
+    if (!*ra)
+        return;
+
+    assert((*ra)->impl == &ra_fns_null);
+    ra_destroy(*ra);
+    *ra = NULL;
+}
+
+const struct ra_null_cmd *ra_null_commands(const struct ra *ra, int *num)
+{
+    assert(ra->impl == &ra_fns_null);
+    struct ra_null *p = ra->priv;
+    *num = p->num_cmds;
+    return p->cmds;
+}
+
+void ra_null_clear_commands(const struct ra *ra)
+{
+    assert(ra->impl == &ra_fns_null);
+    struct ra_null *p = ra->priv;
+    talloc_free(p->log_ctx);
+    p->log_ctx = talloc_new(p);
+    p->cmds = NULL;
+    p->num_cmds = 0;
+}
+
+static void null_tex_destroy(const struct ra *ra, const struct ra_tex *tex)
+{
+    talloc_free((void *) tex);
+}
+
+static const struct ra_tex *null_tex_create(const struct ra *ra,
+                                            const struct ra_tex_params *params)
+{
+    struct ra_tex *tex = talloc_zero(NULL, struct ra_tex);
+    tex->params = *params;
+    tex->params.initial_data = NULL;
+    return tex;
+}
+
+static void null_tex_invalidate(const struct ra *ra, const struct ra_tex *tex)
+{
+}
+
+static void null_tex_clear(const struct ra *ra, const struct ra_tex *tex,
+                           const float color[4])
+{
+}
+
+static void null_tex_blit(const struct ra *ra,
+                          const struct ra_tex *dst, const struct ra_tex *src,
+                          struct pl_rect3d dst_rc, struct pl_rect3d src_rc)
+{
+}
+
+static bool null_tex_upload(const struct ra *ra,
+                            const struct ra_tex_transfer_params *params)
+{
+    return true;
+}
+
+static bool null_tex_download(const struct ra *ra,
+                              const struct ra_tex_transfer_params *params)
+{
+    size_t size = ra_tex_transfer_size(params);
+    if (params->buf) {
+        uint8_t *data = params->buf->priv;
+        memset(data + params->buf_offset, 0, size);
+    } else {
+        memset(params->ptr, 0, size);
+    }
+
+    return true;
+}
+
+// ra_buf.priv points to the host memory backing the buffer
+static void null_buf_destroy(const struct ra *ra, const struct ra_buf *buf)
+{
+    talloc_free((void *) buf);
+}
+
+static const struct ra_buf *null_buf_create(const struct ra *ra,
+                                            const struct ra_buf_params *params)
+{
+    struct ra_buf *buf = talloc_zero(NULL, struct ra_buf);
+    buf->params = *params;
+    buf->params.initial_data = NULL;
+    buf->priv = talloc_zero_size(buf, params->size);
+
+    if (params->initial_data)
+        memcpy(buf->priv, params->initial_data, params->size);
+    if (params->host_mapped)
+        buf->data = buf->priv;
+
+    return buf;
+}
+
+static void null_buf_write(const struct ra *ra, const struct ra_buf *buf,
+                           size_t offset, const void *data, size_t size)
+{
+    memcpy((uint8_t *) buf->priv + offset, data, size);
+}
+
+static bool null_buf_read(const struct ra *ra, const struct ra_buf *buf,
+                          size_t offset, void *dest, size_t size)
+{
+    memcpy(dest, (uint8_t *) buf->priv + offset, size);
+    return true;
+}
+
+static int null_desc_namespace(const struct ra *ra, enum ra_desc_type type)
+{
+    return 0;
+}
+
+static void null_pass_destroy(const struct ra *ra, const struct ra_pass *pass)
+{
+    talloc_free((void *) pass);
+}
+
+static const struct ra_pass *null_pass_create(const struct ra *ra,
+                                              const struct ra_pass_params *params)
+{
+    // Note: This may be called from other threads, so it must not touch any
+    // state shared with the ra
+    struct ra_pass *pass = talloc_zero(NULL, struct ra_pass);
+    pass->params = ra_pass_params_copy(pass, params);
+
+    // There's nothing to compile, so just use the shader text itself as the
+    // "compiled" program, for the benefit of pass caching
+    size_t len = strlen(params->glsl_shader);
+    pass->params.cached_program = talloc_memdup(pass, params->glsl_shader, len);
+    pass->params.cached_program_len = len;
+    return pass;
+}
+
+static void null_pass_run(const struct ra *ra,
+                          const struct ra_pass_run_params *params)
+{
+    struct ra_null *p = ra->priv;
+    if (!p->record)
+        return;
+
+    const struct ra_pass *pass = params->pass;
+    int num_descs = pass->params.num_descriptors;
+    size_t pushc_size = pass->params.push_constants_size;
+
+    struct ra_null_cmd cmd = {
+        .pass = pass,
+        .target = params->target,
+        .desc_bindings = TARRAY_DUP(p->log_ctx, params->desc_bindings, num_descs),
+        .push_constants = pushc_size ? talloc_memdup(p->log_ctx,
+                                params->push_constants, pushc_size) : NULL,
+        .num_var_updates = params->num_var_updates,
+        .vertex_count = params->vertex_count,
+        .compute_groups = {
+            params->compute_groups[0],
+            params->compute_groups[1],
+            params->compute_groups[2],
+        },
+    };
+
+    TARRAY_APPEND(p->log_ctx, p->cmds, p->num_cmds, cmd);
+}
+
+static const struct ra_fns ra_fns_null = {
+    .destroy                = null_destroy,
+    .tex_create             = null_tex_create,
+    .tex_destroy            = null_tex_destroy,
+    .tex_invalidate         = null_tex_invalidate,
+    .tex_clear              = null_tex_clear,
+    .tex_blit               = null_tex_blit,
+    .tex_upload             = null_tex_upload,
+    .tex_download           = null_tex_download,
+    .buf_create             = null_buf_create,
+    .buf_destroy            = null_buf_destroy,
+    .buf_write              = null_buf_write,
+    .buf_read               = null_buf_read,
+    .buf_uniform_layout     = std140_layout,
+    .buf_storage_layout     = std430_layout,
+    .push_constant_layout   = std430_layout,
+    .desc_namespace         = null_desc_namespace,
+    .pass_create            = null_pass_create,
+    .pass_destroy           = null_pass_destroy,
+    .pass_run               = null_pass_run,
+};
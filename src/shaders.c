@@ -16,33 +16,78 @@
  */
 
 #include <stdio.h>
+#include <math.h>
 #include "bstr/bstr.h"
 
 #include "common.h"
 #include "context.h"
 #include "shaders.h"
+#include "siphash.h"
 
 struct pl_shader *pl_shader_alloc(struct pl_context *ctx, const struct ra *ra,
                                   uint8_t ident)
 {
+    // The shader is not attached to `ctx`, since shaders allocated from the
+    // same context may be used from different threads
     assert(ctx);
-    struct pl_shader *sh = talloc_ptrtype(ctx, sh);
+    struct pl_shader *sh = talloc_ptrtype(NULL, sh);
     *sh = (struct pl_shader) {
         .ctx = ctx,
         .ra = ra,
         .mutable = true,
-        .tmp = talloc_new(sh),
+        .tmp = ta_arena_new(sh),
         .ident = ident,
     };
 
     return sh;
 }
 
+static void release_luts(struct pl_shader *sh)
+{
+    for (int i = 0; i < sh->num_luts; i++)
+        sh_lut_unref(&sh->luts[i]);
+    for (int i = 0; i < sh->num_released; i++)
+        sh_lut_unref(&sh->released[i]);
+    sh->num_luts = sh->num_released = 0;
+}
+
 void pl_shader_free(struct pl_shader **sh)
 {
+    if (*sh)
+        release_luts(*sh);
     TA_FREEP(sh);
 }
 
+// Number of entries in a sh_text_cache. This is direct-mapped, i.e. entries
+// whose keys map to the same slot simply replace each other
+#define TEXT_CACHE_SIZE 1024
+
+struct sh_text_entry {
+    uint64_t key;
+    uint64_t hash; // hash of the text, as computed by pl_shader_append
+    struct bstr text[SH_BUF_COUNT];
+    bool valid;
+};
+
+struct sh_text_cache {
+    pthread_mutex_t lock; // protects `entries`
+    struct sh_text_entry entries[TEXT_CACHE_SIZE];
+};
+
+static void text_cache_destroy(void *ptr)
+{
+    struct sh_text_cache *cache = ptr;
+    pthread_mutex_destroy(&cache->lock);
+}
+
+struct sh_text_cache *sh_text_cache_create(void *tactx)
+{
+    struct sh_text_cache *cache = talloc_zero(tactx, struct sh_text_cache);
+    pthread_mutex_init(&cache->lock, NULL);
+    talloc_set_destructor(cache, text_cache_destroy);
+    return cache;
+}
+
 void pl_shader_reset(struct pl_shader *sh, uint8_t ident)
 {
     struct pl_shader new = {
@@ -51,12 +96,19 @@ void pl_shader_reset(struct pl_shader *sh, uint8_t ident)
         .tmp = sh->tmp,
         .mutable = true,
         .ident = ident,
+        .text_cache = sh->text_cache,
+        .names = sh->names,
+        .names_size = sh->names_size,
+        .num_names = sh->num_names,
+        .luts = sh->luts,
+        .released = sh->released,
 
         // Preserve array allocations
         .res = {
             .variables      = sh->res.variables,
             .descriptors    = sh->res.descriptors,
             .vertex_attribs = sh->res.vertex_attribs,
+            .constants      = sh->res.constants,
         },
     };
 
@@ -64,7 +116,8 @@ void pl_shader_reset(struct pl_shader *sh, uint8_t ident)
     for (int i = 0; i < PL_ARRAY_SIZE(new.buffers); i++)
         new.buffers[i] = (struct bstr) { .start = sh->buffers[i].start };
 
-    talloc_free_children(sh->tmp);
+    release_luts(sh);
+    ta_arena_reset(sh->tmp);
     *sh = new;
 }
 
@@ -92,6 +145,7 @@ bool sh_try_compute(struct pl_shader *sh, int bw, int bh, bool flex, size_t mem)
         *sh_bw = bw;
         *sh_bh = bh;
         sh->is_compute = true;
+        sh->flexible_work_groups = flex;
         return true;
     }
 
@@ -133,31 +187,205 @@ bool pl_shader_output_size(const struct pl_shader *sh, int *w, int *h)
     return true;
 }
 
+static void hash_var(uint64_t *hash, const struct ra_var *var)
+{
+    pl_hash_merge(hash, var->type | var->dim_v << 8 | var->dim_m << 16 |
+                        (uint64_t) var->dim_a << 32);
+}
+
+// Returns the parameters of the texture bound by `sd`, which may also be a
+// LUT that was not realized yet
+static const struct ra_tex_params *desc_tex_params(const struct pl_shader *sh,
+                                                   const struct pl_shader_desc *sd)
+{
+    for (int i = 0; i < sh->num_luts; i++) {
+        if (sd->object == sh->luts[i])
+            return &sh->luts[i]->params;
+    }
+
+    const struct ra_tex *tex = sd->object;
+    return &tex->params;
+}
+
+static void hash_desc(uint64_t *hash, const struct pl_shader *sh,
+                      const struct pl_shader_desc *sd)
+{
+    const struct ra_desc *desc = &sd->desc;
+    pl_hash_merge(hash, desc->type | desc->access << 8 |
+                        (uint64_t) desc->binding << 32);
+
+    switch (desc->type) {
+    case RA_DESC_SAMPLED_TEX:
+    case RA_DESC_STORAGE_IMG: {
+        // The texture dimension and (for storage images) the format are part
+        // of the generated declaration
+        const struct ra_tex_params *params = desc_tex_params(sh, sd);
+        pl_hash_merge(hash, ra_tex_params_dimension(*params));
+        if (desc->type == RA_DESC_STORAGE_IMG)
+            pl_hash_merge(hash, bstr_hash64(bstr0(params->format->glsl_format)));
+        break;
+    }
+    case RA_DESC_BUF_UNIFORM:
+    case RA_DESC_BUF_STORAGE:
+        for (int i = 0; i < desc->num_buffer_vars; i++) {
+            const struct ra_buffer_var *bv = &desc->buffer_vars[i];
+            hash_var(hash, &bv->var);
+            pl_hash_merge(hash, bv->layout.offset);
+        }
+        break;
+    default: abort();
+    }
+}
+
 uint64_t pl_shader_signature(const struct pl_shader *sh)
 {
-    uint64_t res = 0;
-    for (int i = 0; i < PL_ARRAY_SIZE(sh->buffers); i++)
-        res ^= bstr_hash64(sh->buffers[i]);
+    // The shader text is hashed incrementally by pl_shader_append, so this
+    // only needs to add the (comparatively small) resource configuration.
+    // Names are not included, since they're already part of the text
+    const struct pl_shader_res *res = &sh->res;
+    uint64_t hash = sh->text_hash;
+    pl_hash_merge(&hash, res->input | res->output << 8 | sh->is_compute << 16);
+
+    for (int i = 0; i < res->num_variables; i++) {
+        hash_var(&hash, &res->variables[i].var);
+        pl_hash_merge(&hash, res->variables[i].dynamic);
+    }
+
+    for (int i = 0; i < res->num_descriptors; i++)
+        hash_desc(&hash, sh, &res->descriptors[i]);
+
+    // The values of specialization constants are not part of the text, but
+    // still require a separate pass (or, for the #define fallback, text)
+    for (int i = 0; i < res->num_constants; i++) {
+        const struct pl_shader_const *sc = &res->constants[i];
+        uint32_t val = 0;
+        memcpy(&val, sc->data, ra_var_type_size(sc->type));
+        pl_hash_merge(&hash, sc->type | (uint64_t) val << 32);
+    }
+
+    for (int i = 0; i < res->num_vertex_attribs; i++) {
+        const struct ra_vertex_attrib *va = &res->vertex_attribs[i].attr;
+        pl_hash_merge(&hash, bstr_hash64(bstr0(va->fmt->name)));
+        pl_hash_merge(&hash, va->offset | (uint64_t) va->location << 32);
+    }
+
+    if (sh->is_compute) {
+        pl_hash_merge(&hash, res->compute_group_size[0] |
+                             (uint64_t) res->compute_group_size[1] << 32);
+        pl_hash_merge(&hash, res->compute_shmem);
+    }
+
+    return hash;
+}
+
+void sh_add_cost(struct pl_shader *sh, struct pl_shader_cost cost)
+{
+    struct pl_shader_cost *c = &sh->res.cost;
+    c->tex_fetches += cost.tex_fetches;
+    c->tex_gathers += cost.tex_gathers;
+    c->transcendentals += cost.transcendentals;
+    c->registers = PL_MAX(c->registers, cost.registers);
+}
 
-    // FIXME: also hash in the configuration of the descriptors/variables
+struct pl_shader_cost pl_shader_get_cost(const struct pl_shader *sh)
+{
+    struct pl_shader_cost cost = sh->res.cost;
+    cost.shmem = sh->res.compute_shmem;
+    return cost;
+}
 
-    return res;
+struct sh_name {
+    uint64_t key;  // see name_key, or 0 for empty slots
+    char *str;     // the identifier, "_<name>_<fresh>_<ident>"
+    size_t len;    // length of <name>
+};
+
+static uint64_t name_key(int fresh, uint8_t ident)
+{
+    return ((uint64_t) ident << 32 | (uint32_t) fresh) + 1;
+}
+
+static struct sh_name *names_slot(struct sh_name *names, int size, uint64_t key)
+{
+    // Fibonacci hashing, since the keys are mostly sequential
+    int mask = size - 1;
+    for (int i = (key * UINT64_C(0x9E3779B97F4A7C15)) >> 40 & mask;;
+         i = (i + 1) & mask)
+    {
+        if (!names[i].key || names[i].key == key)
+            return &names[i];
+    }
+}
+
+static void names_grow(struct pl_shader *sh)
+{
+    int new_size = PL_MAX(sh->names_size * 2, 64);
+    struct sh_name *new = talloc_zero_array(sh, struct sh_name, new_size);
+    for (int i = 0; i < sh->names_size; i++) {
+        struct sh_name *n = &sh->names[i];
+        if (n->key)
+            *names_slot(new, new_size, n->key) = *n;
+    }
+
+    talloc_free(sh->names);
+    sh->names = new;
+    sh->names_size = new_size;
 }
 
 ident_t sh_fresh(struct pl_shader *sh, const char *name)
 {
-    return talloc_asprintf(sh->tmp, "_%s_%d_%u", PL_DEF(name, "var"),
-                           sh->fresh++, sh->ident);
+    name = PL_DEF(name, "var");
+    int fresh = sh->fresh++;
+    uint64_t key = name_key(fresh, sh->ident);
+
+    if (2 * (sh->num_names + 1) > sh->names_size)
+        names_grow(sh);
+
+    struct sh_name *n = names_slot(sh->names, sh->names_size, key);
+    if (n->key) {
+        if (strncmp(n->str + 1, name, n->len) == 0 && !name[n->len])
+            return n->str;
+
+        // Same position, but a different name (e.g. the shader changed)
+        talloc_free(n->str);
+    } else {
+        sh->num_names++;
+    }
+
+    *n = (struct sh_name) {
+        .key = key,
+        .str = talloc_asprintf(sh, "_%s_%d_%u", name, fresh, sh->ident),
+        .len = strlen(name),
+    };
+
+    return n->str;
 }
 
 ident_t sh_var(struct pl_shader *sh, struct pl_shader_var sv)
 {
     sv.var.name = sh_fresh(sh, sv.var.name);
-    sv.data = talloc_memdup(sh->tmp, sv.data, ra_var_host_layout(0, &sv.var).size);
+    sv.data = ta_arena_memdup(sh->tmp, sv.data, ra_var_host_layout(0, &sv.var).size);
     TARRAY_APPEND(sh, sh->res.variables, sh->res.num_variables, sv);
     return (ident_t) sv.var.name;
 }
 
+ident_t sh_const(struct pl_shader *sh, struct pl_shader_const sc)
+{
+    sc.name = sh_fresh(sh, sc.name);
+    sc.data = ta_arena_memdup(sh->tmp, sc.data, ra_var_type_size(sc.type));
+    TARRAY_APPEND(sh, sh->res.constants, sh->res.num_constants, sc);
+    return (ident_t) sc.name;
+}
+
+ident_t sh_const_float(struct pl_shader *sh, const char *name, float val)
+{
+    return sh_const(sh, (struct pl_shader_const) {
+        .type = RA_VAR_FLOAT,
+        .name = name,
+        .data = &val,
+    });
+}
+
 ident_t sh_desc(struct pl_shader *sh, struct pl_shader_desc sd)
 {
     assert(sh->ra);
@@ -191,7 +419,7 @@ ident_t sh_attr_vec2(struct pl_shader *sh, const char *name,
         { rc->x1, rc->y1 },
     };
 
-    float *data = talloc_memdup(sh->tmp, &vals[0][0], sizeof(vals));
+    float *data = ta_arena_memdup(sh->tmp, &vals[0][0], sizeof(vals));
     struct pl_shader_va va = {
         .attr = {
             .name     = sh_fresh(sh, name),
@@ -256,70 +484,397 @@ ident_t sh_bind(struct pl_shader *sh, const struct ra_tex *tex,
     return itex;
 }
 
+ident_t sh_fuse_point(struct pl_shader *sh, const struct ra_tex *tex,
+                      ident_t itex, ident_t pos)
+{
+    const struct sh_deferred *def = sh->deferred;
+    if (!def || !def->sh || def->target != tex || sh->fuse.id)
+        return NULL;
+
+    int idx = sh->res.num_descriptors - 1;
+    assert(idx >= 0 && sh->res.descriptors[idx].object == tex);
+
+    sh->fuse.id = def->id;
+    sh->fuse.name = sh_fresh(sh, "fused");
+    sh->fuse.tex = itex;
+    sh->fuse.pos = pos;
+    sh->fuse.desc_idx = idx;
+    return sh->fuse.name;
+}
+
+static const char *outsigs[] = {
+    [PL_SHADER_SIG_NONE]  = "void",
+    [PL_SHADER_SIG_COLOR] = "vec4",
+};
+
+static const char *insigs[] = {
+    [PL_SHADER_SIG_NONE]  = "",
+    [PL_SHADER_SIG_COLOR] = "vec4 color",
+};
+
+static void define_unfused(struct pl_shader *sh, ident_t name, ident_t tex,
+                           ident_t pos)
+{
+    GLSLH("vec4 %s() { return texture(%s, %s); }\n", name, tex, pos);
+    sh_add_cost(sh, (struct pl_shader_cost) { .tex_fetches = 1 });
+}
+
+// Splices the (mutable) `sub` into `sh` as a function called `name`, with
+// the signature given by the signature of `sub`. All of the resources of
+// `sub` get copied, with the bindings and vertex locations moved after those
+// of `sh`. `sub` itself is not modified.
+static void sh_splice(struct pl_shader *sh, const struct pl_shader *sub,
+                      ident_t name)
+{
+    assert(sub->mutable);
+    const struct pl_shader_res *res = &sub->res;
+
+    // The identifiers of `sub` are unique, so its text can be used as-is
+    GLSLP("%.*s", BSTR_P(sub->buffers[SH_BUF_PRELUDE]));
+    if (sub->fuse.name)
+        define_unfused(sh, sub->fuse.name, sub->fuse.tex, sub->fuse.pos);
+    sh_add_cost(sh, res->cost);
+    GLSLH("%.*s", BSTR_P(sub->buffers[SH_BUF_HEADER]));
+    GLSLH("%s %s(%s) {\n%.*s", outsigs[res->output], name, insigs[res->input],
+          BSTR_P(sub->buffers[SH_BUF_BODY]));
+    if (res->output == PL_SHADER_SIG_COLOR)
+        GLSLH("return color;\n");
+    GLSLH("}\n");
+
+    // Copy all of the resources, since the names and data are owned by `sub`
+    for (int i = 0; i < res->num_variables; i++) {
+        struct pl_shader_var sv = res->variables[i];
+        size_t size = ra_var_host_layout(0, &sv.var).size;
+        sv.var.name = ta_arena_strdup(sh->tmp, sv.var.name);
+        sv.data = ta_arena_memdup(sh->tmp, sv.data, size);
+        TARRAY_APPEND(sh, sh->res.variables, sh->res.num_variables, sv);
+    }
+
+    for (int i = 0; i < res->num_constants; i++) {
+        struct pl_shader_const sc = res->constants[i];
+        sc.name = ta_arena_strdup(sh->tmp, sc.name);
+        sc.data = ta_arena_memdup(sh->tmp, sc.data, ra_var_type_size(sc.type));
+        TARRAY_APPEND(sh, sh->res.constants, sh->res.num_constants, sc);
+    }
+
+    for (int i = 0; i < res->num_descriptors; i++) {
+        struct pl_shader_desc sd = res->descriptors[i];
+        struct ra_desc *desc = &sd.desc;
+        int namespace = ra_desc_namespace(sh->ra, desc->type);
+        desc->name = ta_arena_strdup(sh->tmp, desc->name);
+        desc->binding = sh->current_binding[namespace]++;
+        desc->buffer_vars = ta_arena_memdup(sh->tmp, desc->buffer_vars,
+                desc->num_buffer_vars * sizeof(desc->buffer_vars[0]));
+        for (int n = 0; n < desc->num_buffer_vars; n++) {
+            struct ra_var *var = &desc->buffer_vars[n].var;
+            var->name = ta_arena_strdup(sh->tmp, var->name);
+        }
+        TARRAY_APPEND(sh, sh->res.descriptors, sh->res.num_descriptors, sd);
+    }
+
+    for (int i = 0; i < sub->num_luts; i++)
+        TARRAY_APPEND(sh, sh->luts, sh->num_luts, sh_lut_ref(sub->luts[i]));
+
+    for (int i = 0; i < res->num_vertex_attribs; i++) {
+        struct pl_shader_va va = res->vertex_attribs[i];
+        size_t size = va.attr.fmt->texel_size;
+        va.attr.name = ta_arena_strdup(sh->tmp, va.attr.name);
+        va.attr.offset += sh->current_va_offset;
+        va.attr.location += sh->current_va_location;
+        for (int n = 0; n < PL_ARRAY_SIZE(va.data); n++)
+            va.data[n] = ta_arena_memdup(sh->tmp, va.data[n], size);
+        TARRAY_APPEND(sh, sh->res.vertex_attribs, sh->res.num_vertex_attribs, va);
+    }
+
+    sh->current_va_offset += sub->current_va_offset;
+    sh->current_va_location += sub->current_va_location;
+}
+
+void sh_fuse_resolve(struct pl_shader *sh, const struct pl_shader *sub)
+{
+    ident_t name = sh->fuse.name;
+    if (!name)
+        return;
+
+    sh->fuse.name = NULL;
+    if (!sub) {
+        define_unfused(sh, name, sh->fuse.tex, sh->fuse.pos);
+        return;
+    }
+
+    assert(sub->res.input == PL_SHADER_SIG_NONE);
+    assert(sub->res.output == PL_SHADER_SIG_COLOR);
+    assert(!sub->is_compute);
+
+    TARRAY_REMOVE_AT(sh->res.descriptors, sh->res.num_descriptors,
+                     sh->fuse.desc_idx);
+    sh_splice(sh, sub, name);
+}
+
+bool pl_shader_subpass(struct pl_shader *sh, const struct pl_shader *sub)
+{
+    if (!sub->mutable) {
+        PL_ERR(sh, "Attempted to merge a finalized shader!");
+        return false;
+    }
+
+    if (sub == sh || sub->ident == sh->ident) {
+        PL_ERR(sh, "Attempted to merge shaders with the same identifier!");
+        return false;
+    }
+
+    if (sub->res.output != PL_SHADER_SIG_COLOR) {
+        PL_ERR(sh, "Attempted to merge a shader without output!");
+        return false;
+    }
+
+    if (sub->ra != sh->ra) {
+        PL_ERR(sh, "Attempted to merge shaders belonging to different RAs!");
+        return false;
+    }
+
+    struct pl_shader_res old_res = sh->res;
+    int old_w = sh->output_w, old_h = sh->output_h;
+    if (!sh_require(sh, sub->res.input, sub->output_w, sub->output_h))
+        return false;
+
+    if (sub->is_compute) {
+        const int *bsize = sub->res.compute_group_size;
+        if (!sh_try_compute(sh, bsize[0], bsize[1], sub->flexible_work_groups,
+                            sub->res.compute_shmem))
+        {
+            PL_ERR(sh, "Attempted to merge shaders with incompatible compute "
+                   "shader requirements!");
+            sh->res.input = old_res.input;
+            sh->res.output = old_res.output;
+            sh->output_w = old_w;
+            sh->output_h = old_h;
+            return false;
+        }
+    }
+
+    ident_t name = sh_fresh(sh, "sub");
+    sh_splice(sh, sub, name);
+
+    switch (sub->res.input) {
+    case PL_SHADER_SIG_NONE:
+        GLSL("vec4 color = %s();\n", name);
+        break;
+    case PL_SHADER_SIG_COLOR:
+        GLSL("color = %s(color);\n", name);
+        break;
+    }
+
+    return true;
+}
+
 void pl_shader_append(struct pl_shader *sh, enum pl_shader_buf buf,
                       const char *fmt, ...)
 {
     assert(buf >= 0 && buf < SH_BUF_COUNT);
+    if (sh->key_hit)
+        return;
+
+    struct bstr *str = &sh->buffers[buf];
+    size_t pos = str->len;
 
     va_list ap;
     va_start(ap, fmt);
-    bstr_xappend_vasprintf(sh, &sh->buffers[buf], fmt, ap);
+    bstr_xappend_vasprintf(sh, str, fmt, ap);
     va_end(ap);
+
+    // Update the signature. The buffer index is included so that moving the
+    // same text to a different buffer also changes the signature
+    uint64_t text = siphash64(str->start + pos, str->len - pos);
+    pl_hash_merge(&sh->text_hash, text + buf);
+}
+
+uint64_t sh_key_hash(const char *id, const double *vals, size_t size)
+{
+    uint64_t hash = bstr_hash64(bstr0(id));
+    pl_hash_merge(&hash, siphash64((const uint8_t *) vals, size));
+    return hash;
 }
 
-// Finish the current shader body and return its function name
+void sh_key_begin(struct pl_shader *sh, uint64_t key)
+{
+    if (!sh->text_cache || sh->key_depth++ > 0)
+        return;
+
+    // Mix in all of the state which may influence the generated text, or
+    // the decisions made by the builder
+    const struct pl_shader_res *res = &sh->res;
+    pl_hash_merge(&key, sh->fresh | (uint64_t) sh->ident << 32);
+    pl_hash_merge(&key, res->input | res->output << 8 | sh->mutable << 16 |
+                        sh->is_compute << 17 | sh->flexible_work_groups << 18);
+    pl_hash_merge(&key, sh->output_w | (uint64_t) sh->output_h << 32);
+    pl_hash_merge(&key, res->compute_group_size[0] |
+                        (uint64_t) res->compute_group_size[1] << 32);
+    pl_hash_merge(&key, res->compute_shmem);
+
+    // The text inside the segment is hashed separately, so that the result
+    // can be merged into the signature in one go
+    sh->key = key;
+    sh->key_outer_hash = sh->text_hash;
+    sh->text_hash = 0;
+    for (int i = 0; i < SH_BUF_COUNT; i++)
+        sh->key_pos[i] = sh->buffers[i].len;
+
+    // The entry may get replaced by other threads at any time, so the cached
+    // text is spliced in right away, rather than in sh_key_end
+    struct sh_text_cache *cache = sh->text_cache;
+    pthread_mutex_lock(&cache->lock);
+    const struct sh_text_entry *entry = &cache->entries[key % TEXT_CACHE_SIZE];
+    sh->key_hit = entry->valid && entry->key == key;
+    if (sh->key_hit) {
+        for (int i = 0; i < SH_BUF_COUNT; i++)
+            bstr_xappend(sh, &sh->buffers[i], entry->text[i]);
+        sh->text_hash = entry->hash;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void sh_key_end(struct pl_shader *sh, bool ok)
+{
+    if (!sh->text_cache || --sh->key_depth > 0)
+        return;
+
+    uint64_t hash = sh->text_hash;
+    sh->text_hash = sh->key_outer_hash;
+
+    if (sh->key_hit) {
+        sh->key_hit = false;
+        if (ok) {
+            pl_hash_merge(&sh->text_hash, hash);
+        } else {
+            // The builder bailed out, so it would not have generated the text
+            for (int i = 0; i < SH_BUF_COUNT; i++)
+                sh->buffers[i].len = sh->key_pos[i];
+        }
+        return;
+    }
+
+    pl_hash_merge(&sh->text_hash, hash);
+    if (!ok)
+        return;
+
+    struct sh_text_cache *cache = sh->text_cache;
+    pthread_mutex_lock(&cache->lock);
+    struct sh_text_entry *entry = &cache->entries[sh->key % TEXT_CACHE_SIZE];
+    for (int i = 0; i < SH_BUF_COUNT; i++) {
+        struct bstr text = bstr_cut(sh->buffers[i], sh->key_pos[i]);
+        entry->text[i].len = 0;
+        bstr_xappend(cache, &entry->text[i], text);
+    }
+
+    entry->key = sh->key;
+    entry->hash = hash;
+    entry->valid = true;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Finish the current shader body and return its function name. The body
+// itself stays where it is; only the function prototype and the closing
+// text are generated, as separate segments
 static ident_t sh_split(struct pl_shader *sh)
 {
     assert(sh->mutable);
 
-    static const char *outsigs[] = {
-        [PL_SHADER_SIG_NONE]  = "void",
-        [PL_SHADER_SIG_COLOR] = "vec4",
-    };
-
-    static const char *insigs[] = {
-        [PL_SHADER_SIG_NONE]  = "",
-        [PL_SHADER_SIG_COLOR] = "vec4 color",
+    static const char *close[] = {
+        [PL_SHADER_SIG_NONE]  = "}\n",
+        [PL_SHADER_SIG_COLOR] = "return color;\n}\n",
     };
 
-    // Concatenate the body onto the head as a new function
     ident_t name = sh_fresh(sh, "main");
-    GLSLH("%s %s(%s) {\n", outsigs[sh->res.output], name, insigs[sh->res.input]);
+    char *open = ta_arena_asprintf(sh->tmp, "%s %s(%s) {\n",
+                                   outsigs[sh->res.output], name,
+                                   insigs[sh->res.input]);
+
+    struct bstr *segs = sh->segments;
+    segs[0] = sh->buffers[SH_BUF_PRELUDE];
+    segs[1] = sh->buffers[SH_BUF_HEADER];
+    segs[2] = bstr0(open);
+    segs[3] = sh->buffers[SH_BUF_BODY];
+    segs[4] = bstr0(close[sh->res.output]);
+    return name;
+}
 
-    if (sh->buffers[SH_BUF_BODY].len) {
-        bstr_xappend(sh, &sh->buffers[SH_BUF_HEADER], sh->buffers[SH_BUF_BODY]);
-        sh->buffers[SH_BUF_BODY].len = 0;
-        sh->buffers[SH_BUF_BODY].start[0] = '\0'; // for sanity / efficiency
-    }
+const struct pl_shader_res *sh_finalize(struct pl_shader *sh)
+{
+    assert(sh->mutable);
 
-    switch (sh->res.output) {
-    case PL_SHADER_SIG_NONE: break;
-    case PL_SHADER_SIG_COLOR:
-        GLSLH("return color;\n");
-        break;
+    // Shaders which are not dispatched can't be fused into
+    sh_fuse_resolve(sh, NULL);
+
+    // Without support for specialization constants, inline their values
+    if (!sh->ra || !(sh->ra->caps & RA_CAP_SPEC_CONSTANTS)) {
+        for (int i = 0; i < sh->res.num_constants; i++) {
+            const struct pl_shader_const *sc = &sh->res.constants[i];
+            switch (sc->type) {
+            case RA_VAR_SINT:
+                GLSLP("#define %s %d\n", sc->name, *(const int *) sc->data);
+                break;
+            case RA_VAR_UINT:
+                GLSLP("#define %s %uu\n", sc->name,
+                      *(const unsigned int *) sc->data);
+                break;
+            case RA_VAR_FLOAT: {
+                // GLSL has no literals for non-finite values, so these have
+                // to be written as expressions instead
+                float val = *(const float *) sc->data;
+                if (isnan(val)) {
+                    GLSLP("#define %s (0.0/0.0)\n", sc->name);
+                } else if (isinf(val)) {
+                    GLSLP("#define %s (%s1.0/0.0)\n", sc->name,
+                          val < 0 ? "-" : "");
+                } else {
+                    GLSLP("#define %s float(%.9g)\n", sc->name, val);
+                }
+                break;
+            }
+            default: abort();
+            }
+        }
+        sh->res.num_constants = 0;
     }
 
-    GLSLH("}\n");
-    return name;
+    // Split the shader. This must come last, since the segments point into
+    // the shader's buffers, which get moved by further appends
+    sh->res.name = sh_split(sh);
+    sh->res.glsl = NULL;
+    sh->res.cost = pl_shader_get_cost(sh);
+    sh->mutable = false;
+    return &sh->res;
 }
 
 const struct pl_shader_res *pl_shader_finalize(struct pl_shader *sh)
 {
-    if (!sh->mutable) {
+    if (!sh_lut_realize(sh))
+        return NULL;
+
+    if (sh->mutable) {
+        sh_finalize(sh);
+    } else if (sh->res.glsl) {
         PL_WARN(sh, "Attempted to finalize a shader twice?");
         return &sh->res;
     }
 
-    // Split the shader. This finalizes the body and adds it to the header
-    sh->res.name = sh_split(sh);
-
-    // Concatenate the header onto the prelude to form the final output
-    struct bstr *glsl = &sh->buffers[SH_BUF_PRELUDE];
-    bstr_xappend(sh, glsl, sh->buffers[SH_BUF_HEADER]);
+    // Concatenate all of the segments to form the final output
+    size_t len = 0;
+    for (int i = 0; i < SH_NUM_SEGMENTS; i++)
+        len += sh->segments[i].len;
+
+    char *glsl = ta_arena_alloc(sh->tmp, len + 1);
+    size_t pos = 0;
+    for (int i = 0; i < SH_NUM_SEGMENTS; i++) {
+        const struct bstr seg = sh->segments[i];
+        if (seg.len)
+            memcpy(glsl + pos, seg.start, seg.len);
+        pos += seg.len;
+    }
+    glsl[len] = '\0';
 
-    // Update the result pointer and return
-    sh->res.glsl = glsl->start;
-    sh->mutable = false;
+    sh->res.glsl = glsl;
     return &sh->res;
 }
 
@@ -356,10 +911,11 @@ bool sh_require(struct pl_shader *sh, enum pl_shader_sig insig, int w, int h)
         return false;
     }
 
-    // All of our shaders end up returning a vec4 color
+    // All of our shaders end up returning a vec4 color. Operations without
+    // size requirements preserve those of the previous operations
     sh->res.output = PL_SHADER_SIG_COLOR;
-    sh->output_w = w;
-    sh->output_h = h;
+    sh->output_w = PL_DEF(w, sh->output_w);
+    sh->output_h = PL_DEF(h, sh->output_h);
     return true;
 }
 
@@ -369,10 +925,9 @@ void pl_shader_obj_destroy(struct pl_shader_obj **ptr)
     if (!obj)
         return;
 
-    if (obj->ra) {
+    if (obj->ra)
         ra_buf_destroy(obj->ra, &obj->buf);
-        ra_tex_destroy(obj->ra, &obj->tex);
-    }
+    sh_lut_unref(&obj->lut);
 
     *ptr = NULL;
     talloc_free(obj);
@@ -406,10 +961,298 @@ bool sh_require_obj(struct pl_shader *sh, struct pl_shader_obj **ptr,
     return true;
 }
 
+struct sh_lut *sh_lut_create(const struct ra *ra,
+                             const struct ra_tex_params *params,
+                             const struct pl_filter *filter)
+{
+    struct sh_lut *lut = talloc_ptrtype(NULL, lut);
+    *lut = (struct sh_lut) {
+        .ra = ra,
+        .params = *params,
+        .filter = filter,
+        .refcount = 1,
+    };
+
+    pthread_mutex_init(&lut->lock, NULL);
+    return lut;
+}
+
+struct sh_lut *sh_lut_ref(struct sh_lut *lut)
+{
+    pthread_mutex_lock(&lut->lock);
+    lut->refcount++;
+    pthread_mutex_unlock(&lut->lock);
+    return lut;
+}
+
+void sh_lut_unref(struct sh_lut **ptr)
+{
+    struct sh_lut *lut = *ptr;
+    if (!lut)
+        return;
+
+    *ptr = NULL;
+    pthread_mutex_lock(&lut->lock);
+    bool last = --lut->refcount == 0;
+    pthread_mutex_unlock(&lut->lock);
+    if (!last)
+        return;
+
+    ra_tex_destroy(lut->ra, &lut->tex);
+    pl_filter_free(&lut->filter);
+    pthread_mutex_destroy(&lut->lock);
+    talloc_free(lut);
+}
+
+// Filter scales are rounded to multiples of 1/LUT_SCALE_STEPS, which keeps
+// the error in the filter size below 0.1% (for the scales >= 1.0 used by
+// polar sampling), while letting similar scaling ratios share the same LUT
+#define LUT_SCALE_STEPS 512
+
+// Default for `pl_context_params.lut_cache_size`
+#define LUT_CACHE_SIZE 16
+
+struct sh_lut_cache {
+    pthread_mutex_t lock; // protects `luts`
+    int capacity;
+    struct sh_lut **luts; // ordered by last use, most recently used last
+    int num_luts;
+};
+
+struct sh_lut_cache *sh_lut_cache_create(struct pl_context *ctx)
+{
+    int size = ctx->params.lut_cache_size;
+    struct sh_lut_cache *cache = talloc_ptrtype(ctx, cache);
+    *cache = (struct sh_lut_cache) {
+        .capacity = size ? PL_MAX(size, 0) : LUT_CACHE_SIZE,
+    };
+
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void sh_lut_cache_flush(struct sh_lut_cache *cache, const struct ra *ra)
+{
+    pthread_mutex_lock(&cache->lock);
+    for (int i = cache->num_luts - 1; i >= 0; i--) {
+        if (cache->luts[i]->ra == ra) {
+            sh_lut_unref(&cache->luts[i]);
+            TARRAY_REMOVE_AT(cache->luts, cache->num_luts, i);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void sh_lut_cache_destroy(struct sh_lut_cache **ptr)
+{
+    struct sh_lut_cache *cache = *ptr;
+    if (!cache)
+        return;
+
+    for (int i = 0; i < cache->num_luts; i++)
+        sh_lut_unref(&cache->luts[i]);
+    pthread_mutex_destroy(&cache->lock);
+    TA_FREEP(ptr);
+}
+
+static bool filter_params_eq(const struct pl_filter_params *a,
+                             const struct pl_filter_params *b)
+{
+    return pl_filter_config_eq(&a->config, &b->config) &&
+           a->lut_entries      == b->lut_entries &&
+           a->filter_scale     == b->filter_scale &&
+           a->max_error        == b->max_error &&
+           a->approximate      == b->approximate &&
+           a->lut_type         == b->lut_type &&
+           a->pack_rgba        == b->pack_rgba &&
+           a->cutoff           == b->cutoff &&
+           a->max_row_size     == b->max_row_size &&
+           a->row_stride_align == b->row_stride_align;
+}
+
+// The filter may have picked a different size than requested (see
+// `pl_filter_params.max_error`), so compare against the requested one
+static bool lut_matches(const struct sh_lut *lut,
+                        const struct pl_filter_params *params)
+{
+    struct pl_filter_params fparams = lut->filter->params;
+    fparams.lut_entries = lut->lut_entries;
+    return filter_params_eq(&fparams, params);
+}
+
+// Looks up a matching LUT in the cache and returns a new reference to it, or
+// NULL if there is none. Must be called with the cache locked
+static struct sh_lut *cache_lookup(struct sh_lut_cache *cache,
+                                   const struct ra *ra,
+                                   const struct pl_filter_params *params)
+{
+    for (int i = cache->num_luts - 1; i >= 0; i--) {
+        struct sh_lut *lut = cache->luts[i];
+        if (lut->ra != ra || !lut_matches(lut, params))
+            continue;
+
+        // Move it to the end, to mark it as most recently used
+        TARRAY_REMOVE_AT(cache->luts, cache->num_luts, i);
+        TARRAY_APPEND(cache, cache->luts, cache->num_luts, lut);
+        return sh_lut_ref(lut);
+    }
+
+    return NULL;
+}
+
+// Returns the texture format for a LUT of the given type, or NULL
+static const struct ra_fmt *lut_fmt(const struct ra *ra,
+                                    const struct pl_filter_params *params)
+{
+    static const struct { enum ra_fmt_type type; int bits; } fmts[] = {
+        [PL_FILTER_LUT_FLOAT]   = {RA_FMT_FLOAT, 32},
+        [PL_FILTER_LUT_HALF]    = {RA_FMT_FLOAT, 16},
+        [PL_FILTER_LUT_SNORM16] = {RA_FMT_SNORM, 16},
+    };
+
+    assert(params->lut_type < PL_ARRAY_SIZE(fmts));
+    int comps = params->pack_rgba ? 4 : 1;
+    return ra_find_fmt(ra, fmts[params->lut_type].type, comps,
+                       fmts[params->lut_type].bits, true,
+                       RA_FMT_CAP_SAMPLEABLE | RA_FMT_CAP_LINEAR);
+}
+
+bool sh_lut_filter(struct pl_shader *sh, struct sh_lut **lut,
+                   const struct pl_filter_params *params)
+{
+    struct pl_filter_params qparams = *params;
+    qparams.filter_scale = roundf(params->filter_scale * LUT_SCALE_STEPS) /
+                           LUT_SCALE_STEPS;
+    qparams.pack_rgba &= !params->config.polar;
+
+    if (*lut && (*lut)->ra == sh->ra && lut_matches(*lut, &qparams))
+    {
+        return true;
+    }
+
+    struct sh_lut_cache *cache = sh->ctx->lut_cache;
+    pthread_mutex_lock(&cache->lock);
+    struct sh_lut *new = cache_lookup(cache, sh->ra, &qparams);
+    pthread_mutex_unlock(&cache->lock);
+
+    if (new) {
+        PL_DEBUG(sh, "Re-using cached filter LUT");
+        goto done;
+    }
+
+    const struct ra_fmt *fmt = lut_fmt(sh->ra, &qparams);
+    if (!fmt && qparams.lut_type != PL_FILTER_LUT_FLOAT) {
+        // The compact LUT types are purely an optimization
+        PL_DEBUG(sh, "Compact LUT type unsupported, falling back to float");
+        qparams.lut_type = PL_FILTER_LUT_FLOAT;
+        return sh_lut_filter(sh, lut, &qparams);
+    }
+
+    if (!fmt) {
+        PL_WARN(sh, "Found no matching texture format for filter LUT");
+        return false;
+    }
+
+    // Generating the filter may take a while, so don't block the cache
+    PL_INFO(sh, "Generating filter LUT");
+    const struct pl_filter *filter = pl_filter_generate(sh->ctx, &qparams);
+    if (!filter) {
+        // This should never happen, but just in case ..
+        PL_ERR(sh, "Failed initializing filter!");
+        return false;
+    }
+
+    // Polar LUTs are 1D, separable LUTs have one row per phase
+    struct ra_tex_params tex_params = {
+        .w              = filter->params.lut_entries,
+        .format         = fmt,
+        .sampleable     = true,
+        .sample_mode    = RA_TEX_SAMPLE_LINEAR,
+        .address_mode   = RA_TEX_ADDRESS_CLAMP,
+        .initial_data   = filter->lut,
+    };
+
+    if (!qparams.config.polar) {
+        tex_params.w = filter->row_stride / fmt->num_components;
+        tex_params.h = filter->params.lut_entries;
+    }
+
+    new = sh_lut_create(sh->ra, &tex_params, filter);
+    new->lut_entries = qparams.lut_entries;
+
+    if (!cache->capacity)
+        goto done;
+
+    // Another thread may have added the same LUT in the meantime, in which
+    // case that one is used instead, so that there's only a single copy
+    pthread_mutex_lock(&cache->lock);
+    struct sh_lut *dup = cache_lookup(cache, sh->ra, &qparams);
+    if (dup) {
+        sh_lut_unref(&new);
+        new = dup;
+    } else {
+        if (cache->num_luts == cache->capacity) {
+            // Evicted LUTs may hold a texture, so let the shader release them
+            TARRAY_APPEND(sh, sh->released, sh->num_released, cache->luts[0]);
+            TARRAY_REMOVE_AT(cache->luts, cache->num_luts, 0);
+        }
+        TARRAY_APPEND(cache, cache->luts, cache->num_luts, sh_lut_ref(new));
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+done:
+    // The previous LUT may still be in use by shaders that were not
+    // dispatched yet. Hand the reference over to this shader, so it gets
+    // released by pl_shader_reset rather than from this thread
+    if (*lut)
+        TARRAY_APPEND(sh, sh->released, sh->num_released, *lut);
+    *lut = new;
+    return true;
+}
+
+ident_t sh_lut_desc(struct pl_shader *sh, struct sh_lut *lut, const char *name)
+{
+    assert(lut->ra == sh->ra);
+    TARRAY_APPEND(sh, sh->luts, sh->num_luts, sh_lut_ref(lut));
+    return sh_desc(sh, (struct pl_shader_desc) {
+        .desc = {
+            .name = name,
+            .type = RA_DESC_SAMPLED_TEX,
+        },
+        .object = lut,
+    });
+}
+
+bool sh_lut_realize(struct pl_shader *sh)
+{
+    for (int i = 0; i < sh->num_luts; i++) {
+        struct sh_lut *lut = sh->luts[i];
+        pthread_mutex_lock(&lut->lock);
+        if (!lut->tex)
+            lut->tex = ra_tex_create(lut->ra, &lut->params);
+        const struct ra_tex *tex = lut->tex;
+        pthread_mutex_unlock(&lut->lock);
+
+        if (!tex) {
+            PL_ERR(sh, "Failed creating LUT texture!");
+            return false;
+        }
+
+        for (int n = 0; n < sh->res.num_descriptors; n++) {
+            struct pl_shader_desc *sd = &sh->res.descriptors[n];
+            if (sd->object == lut)
+                sd->object = tex;
+        }
+    }
+
+    return true;
+}
+
 ident_t sh_lut_pos(struct pl_shader *sh, int lut_size)
 {
     ident_t name = sh_fresh(sh, "LUT_POS");
-    GLSLH("#define %s(x) mix(%f, %f, (x)) \n",
-          name, 0.5 / lut_size, 1.0 - 0.5 / lut_size);
+    ident_t size = sh_const_float(sh, "lut_size", lut_size);
+    GLSLH("#define %s(x) mix(0.5 / %s, 1.0 - 0.5 / %s, (x)) \n",
+          name, size, size);
     return name;
 }
@@ -18,7 +18,9 @@
 #pragma once
 
 #include <stdio.h>
+#include <pthread.h>
 #include "bstr/bstr.h"
+#include "ta/arena.h"
 
 #include "common.h"
 #include "context.h"
@@ -36,6 +38,25 @@ enum pl_shader_buf {
     SH_BUF_COUNT,
 };
 
+// Cache of generated shader text, indexed by structural keys. See sh_key_begin.
+// The cache is thread-safe, so it may be shared by shaders which are being
+// built on different threads.
+struct sh_text_cache;
+
+struct sh_text_cache *sh_text_cache_create(void *tactx);
+
+// Number of segments making up the text of a finalized shader
+#define SH_NUM_SEGMENTS 5
+
+// A finished shader whose execution was deferred by the owner (e.g. by
+// pl_dispatch), in the hope that it can be fused into a later shader which
+// samples its target. See sh_fuse_point.
+struct sh_deferred {
+    struct pl_shader *sh;        // NULL if there's nothing deferred
+    const struct ra_tex *target; // the texture `sh` would have rendered to
+    uint64_t id;                 // unique for every deferred shader
+};
+
 struct pl_shader {
     // Read-only fields
     struct pl_context *ctx;
@@ -47,11 +68,19 @@ struct pl_shader {
     int output_h;
     struct pl_shader_res res; // for accumulating vertex_attribs etc.
     struct bstr buffers[SH_BUF_COUNT];
+    uint64_t text_hash; // running hash of all text added by pl_shader_append
     bool is_compute;
     bool flexible_work_groups;
     uint8_t ident;
     int fresh;
-    void *tmp;
+    struct ta_arena *tmp; // temporary allocations, reset by pl_shader_reset
+
+    // Identifiers rendered by sh_fresh, preserved across pl_shader_reset.
+    // Open-addressing hash table indexed by `ident` and `fresh`, with a
+    // power-of-two size
+    struct sh_name *names;
+    int names_size;
+    int num_names;
 
     // For vertex attributes, since we need to keep track of their location
     int current_va_location;
@@ -59,6 +88,37 @@ struct pl_shader {
 
     // For bindings, since we need to keep the namespaces unique
     int current_binding[RA_DESC_TYPE_COUNT];
+
+    // For structural keys, see sh_key_begin
+    struct sh_text_cache *text_cache; // set by the owner (e.g. pl_dispatch)
+    int key_depth;
+    uint64_t key;
+    bool key_hit; // if true, the text is suppressed
+    size_t key_pos[SH_BUF_COUNT];
+    uint64_t key_outer_hash;
+
+    // The text of the finalized shader, as the concatenation of these
+    // segments. Only valid once the shader was finalized, see sh_finalize
+    struct bstr segments[SH_NUM_SEGMENTS];
+
+    // References to the LUTs used by this shader, see sh_lut_desc
+    struct sh_lut **luts;
+    int num_luts;
+
+    // References which are only held so that they get dropped on the thread
+    // using the RA (by pl_shader_reset), see sh_lut_filter. These LUTs are
+    // not used by the shader, so they never get realized
+    struct sh_lut **released;
+    int num_released;
+
+    // For pass fusion, see sh_fuse_point
+    const struct sh_deferred *deferred; // set by the owner (e.g. pl_dispatch)
+    struct {
+        uint64_t id;      // `deferred->id` at the time of sh_fuse_point
+        ident_t name;     // function to define, or NULL if resolved/unused
+        ident_t tex, pos; // for sampling the texture after all
+        int desc_idx;     // index of the descriptor binding `tex`
+    } fuse;
 };
 
 // Attempt enabling compute shaders for this pass, if possible
@@ -67,11 +127,27 @@ bool sh_try_compute(struct pl_shader *sh, int bw, int bh, bool flex, size_t mem)
 // Helpers for adding new variables/descriptors/etc. with fresh, unique
 // identifier names. These will never conflcit with other identifiers, even
 // if the shaders are merged together.
+//
+// Identifiers are determined by the name, the shader's `ident` and the number
+// of identifiers generated before. Since re-generating the same shader after
+// pl_shader_reset thus produces the same identifiers, they're interned: only
+// the first use of an identifier formats and allocates its string.
 ident_t sh_fresh(struct pl_shader *sh, const char *name);
 
 // Add a new shader var and return its identifier
 ident_t sh_var(struct pl_shader *sh, struct pl_shader_var sv);
 
+// Add a new specialization constant and return its identifier. Constants
+// behave like `const` variables in the shader text, but their values are not
+// part of the text: on RAs with RA_CAP_SPEC_CONSTANTS, they're assigned at
+// pass creation time, so the same compiled program can be re-used for other
+// values. Otherwise, pl_shader_finalize turns them into #defines. Values that
+// change frequently (e.g. every frame) should use sh_var instead.
+ident_t sh_const(struct pl_shader *sh, struct pl_shader_const sc);
+
+// Helper to add a float constant
+ident_t sh_const_float(struct pl_shader *sh, const char *name, float val);
+
 // Add a new shader desc and return its identifier. This function takes care of
 // setting the binding to a fresh bind point according to the namespace
 // requirements, so the caller may leave it blank.
@@ -92,6 +168,32 @@ ident_t sh_bind(struct pl_shader *sh, const struct ra_tex *tex,
                 const char *name, const struct pl_rect2df *rect,
                 ident_t *out_pos, ident_t *out_size, ident_t *out_pt);
 
+// Pass fusion: If `tex` is the target of the currently deferred shader (see
+// `sh->deferred`), this returns the name of a function `vec4 name()` which
+// the caller must use instead of sampling `tex` at `pos`, and NULL otherwise.
+// This must only be used for pointwise samples, i.e. if every output pixel
+// corresponds to exactly the texel of `tex` at the same position, and `tex`
+// must have been bound (by sh_bind) immediately before calling this. Only
+// the first such sample in a shader can be fused.
+ident_t sh_fuse_point(struct pl_shader *sh, const struct ra_tex *tex,
+                      ident_t itex, ident_t pos);
+
+// Defines the function returned by sh_fuse_point, either by inlining `sub`
+// (which must be the deferred shader it refers to) or, if `sub` is NULL, by
+// sampling the texture after all. In the former case, the descriptor binding
+// the texture is removed, since it's no longer needed. `sub` itself is not
+// modified, and can still be dispatched normally afterwards. Does nothing if
+// there's no unresolved fusion point.
+void sh_fuse_resolve(struct pl_shader *sh, const struct pl_shader *sub);
+
+// Finalizes the shader like pl_shader_finalize, except that the shader text
+// is not concatenated: `res->glsl` is left as NULL, and the text is instead
+// given by `sh->segments`, which remain valid until the shader is reset. This
+// is for callers which copy the text into a larger string anyway, to avoid
+// copying the (potentially large) text multiple times. pl_shader_finalize may
+// still be called on the shader afterwards, to produce `res->glsl`.
+const struct pl_shader_res *sh_finalize(struct pl_shader *sh);
+
 // Underlying function for appending text to a shader
 void pl_shader_append(struct pl_shader *sh, enum pl_shader_buf buf,
                       const char *fmt, ...)
@@ -101,6 +203,32 @@ void pl_shader_append(struct pl_shader *sh, enum pl_shader_buf buf,
 #define GLSLH(...) pl_shader_append(sh, SH_BUF_HEADER, __VA_ARGS__)
 #define GLSL(...)  pl_shader_append(sh, SH_BUF_BODY, __VA_ARGS__)
 
+// Structural keys: A shader builder may bracket the part of its code that
+// generates text with sh_key_begin/sh_key_end, passing a key that uniquely
+// determines the generated text (together with the current state of the
+// shader, which is mixed in automatically). If the shader has a text cache
+// and the same key was seen before, pl_shader_append becomes a no-op inside
+// the bracket and the cached text is spliced in by sh_key_begin instead. Only
+// the text is skipped - variables, descriptors etc. must still be added as
+// usual, since their contents may differ. Nested brackets are covered by the
+// key of the outermost one. `ok` must be false if the builder failed for
+// reasons not covered by the key (e.g. failing to create a resource), in
+// which case the text is not cached.
+void sh_key_begin(struct pl_shader *sh, uint64_t key);
+void sh_key_end(struct pl_shader *sh, bool ok);
+
+// Helper to compute a key from a builder-specific identifier and a list of
+// numbers. Every value which influences the generated text must be included.
+uint64_t sh_key_hash(const char *id, const double *vals, size_t size);
+#define SH_KEY(id, ...) \
+    sh_key_hash(id, (const double[]) { __VA_ARGS__ }, \
+                sizeof((const double[]) { __VA_ARGS__ }))
+
+// Accounts for the estimated cost of the operations added by a shader builder.
+// The counts are added up, while the register hint is the maximum of all
+// builders. `cost.shmem` is ignored, since that's tracked by sh_try_compute.
+void sh_add_cost(struct pl_shader *sh, struct pl_shader_cost cost);
+
 // Requires that the share is mutable, has an output signature compatible
 // with the given input signature, as well as an output size compatible with
 // the given size requirements. Errors and returns false otherwise.
@@ -111,6 +239,68 @@ bool sh_require(struct pl_shader *sh, enum pl_shader_sig insig, int w, int h);
 // sample in a texture of dimension `lut_size`.
 ident_t sh_lut_pos(struct pl_shader *sh, int lut_size);
 
+// A LUT texture with immutable contents, which is shared by reference between
+// the pl_shader_obj that generated it and all shaders using it. The texture
+// itself is only created once a shader using the LUT gets realized (see
+// sh_lut_realize), so LUTs can be generated from any thread, without touching
+// the RA. The reference count and the texture are protected by `lock`.
+struct sh_lut {
+    const struct ra *ra;
+    struct ra_tex_params params;    // `initial_data` points into `filter`
+    const struct pl_filter *filter; // owned by the LUT
+    int lut_entries; // as requested, which may differ from `filter` (max_error)
+    const struct ra_tex *tex;       // NULL until realized
+    int refcount;
+    pthread_mutex_t lock;
+};
+
+// Creates a new LUT with a reference count of 1, taking over ownership of
+// `filter`. `params->initial_data` must remain valid for the lifetime of the
+// LUT, e.g. by pointing into `filter->weights`.
+struct sh_lut *sh_lut_create(const struct ra *ra,
+                             const struct ra_tex_params *params,
+                             const struct pl_filter *filter);
+
+struct sh_lut *sh_lut_ref(struct sh_lut *lut);
+
+// Drops a reference and sets `*lut` to NULL. Dropping the last reference
+// destroys the texture, if it was created, so this must only happen on the
+// thread using the RA.
+void sh_lut_unref(struct sh_lut **lut);
+
+// Updates `*lut` to a LUT containing the filter described by `params`, as a
+// 1D texture of `params->lut_entries` texels for polar filters, or a 2D
+// texture with one row per entry for separable filters. The texture format
+// follows `params->lut_type` (falling back to floats if the RA doesn't
+// support it) and `params->pack_rgba`. If `*lut` does not match already, the
+// LUT is taken from the context's LUT cache, or generated (and added to the
+// cache) if there is none. `filter_scale` is quantized first, so that similar
+// scaling ratios share the same LUT. The reference previously held by `*lut`
+// (as well as any LUTs evicted from the cache) is handed over to `sh`.
+// Returns false on failure.
+bool sh_lut_filter(struct pl_shader *sh, struct sh_lut **lut,
+                   const struct pl_filter_params *params);
+
+// Cache of filter LUTs, shared by all shaders using the same pl_context. This
+// is thread-safe. sh_lut_cache_flush drops all LUTs belonging to `ra`, and
+// must be called before the RA is destroyed. (ra_destroy does this)
+struct sh_lut_cache;
+
+struct sh_lut_cache *sh_lut_cache_create(struct pl_context *ctx);
+void sh_lut_cache_flush(struct sh_lut_cache *cache, const struct ra *ra);
+void sh_lut_cache_destroy(struct sh_lut_cache **cache);
+
+// Adds a sampled texture descriptor for `lut` and makes the shader hold a
+// reference to it. Until the shader is realized, the descriptor's `object`
+// points to the sh_lut rather than a ra_tex.
+ident_t sh_lut_desc(struct pl_shader *sh, struct sh_lut *lut, const char *name);
+
+// Creates the textures of all LUTs used by this shader (if not already done)
+// and points the descriptors referring to them to the textures. This must be
+// called from the thread using the RA, before the descriptors are used.
+// Returns false (and logs an error) if any of the textures failed to create.
+bool sh_lut_realize(struct pl_shader *sh);
+
 // Shader resources
 
 enum pl_shader_obj_type {
@@ -125,8 +315,7 @@ struct pl_shader_obj {
 
     // The following fields are for free use by the shader
     const struct ra_buf *buf;
-    const struct ra_tex *tex;
-    const struct pl_filter *filter;
+    struct sh_lut *lut;
 };
 
 bool sh_require_obj(struct pl_shader *sh, struct pl_shader_obj **ptr,
@@ -25,7 +25,13 @@ void pl_shader_decode_color(struct pl_shader *sh, struct pl_color_repr *repr,
     if (!sh_require(sh, PL_SHADER_SIG_COLOR, 0, 0))
         return;
 
+    sh_key_begin(sh, SH_KEY("decode_color", repr->sys, repr->levels,
+                            repr->alpha, repr->bits.sample_depth,
+                            repr->bits.color_depth, repr->bits.bit_shift,
+                            texture_bits));
+
     GLSL("// pl_shader_decode_color\n");
+    int pows = 0; // for the cost estimate
 
     // For the non-linear color systems we need some special input handling
     // to make sure we don't accidentally screw everything up because of the
@@ -40,6 +46,7 @@ void pl_shader_decode_color(struct pl_shader *sh, struct pl_color_repr *repr,
     if (repr->sys == PL_COLOR_SYSTEM_XYZ) {
         float scale = pl_color_repr_normalize(repr);
         GLSL("color.rgb = pow(%f * color.rgb, vec3(2.6));\n", scale);
+        pows += 3;
     }
 
     enum pl_color_system orig_sys = repr->sys;
@@ -89,12 +96,20 @@ void pl_shader_decode_color(struct pl_shader *sh, struct pl_color_repr *repr,
              "                vec3(1.0993) * pow(color.rgb, vec3(0.45)) \n"
              "                   - vec3(0.0993),                        \n"
              "                lessThanEqual(vec3(0.0181), color.rgb));  \n");
+        pows += 6;
     }
 
     if (repr->alpha == PL_ALPHA_INDEPENDENT) {
         GLSL("color.rgb *= vec3(color.a)\n");
         repr->alpha = PL_ALPHA_PREMULTIPLIED;
     }
+
+    sh_key_end(sh, true);
+
+    sh_add_cost(sh, (struct pl_shader_cost) {
+        .transcendentals = pows,
+        .registers       = 1,
+    });
 }
 
 // Common constants for SMPTE ST.2084 (PQ)
@@ -135,6 +150,7 @@ void pl_shader_linearize(struct pl_shader *sh, enum pl_color_transfer trc)
     // displayed on the display where such would be possible. That said, the
     // problem is that not all gamma curves are well-defined on the values
     // outside this range, so we ignore it and just clamp anyway for sanity.
+    sh_key_begin(sh, SH_KEY("linearize", trc));
     GLSL("// pl_shader_linearize           \n"
          "color.rgb = max(color.rgb, 0.0); \n");
 
@@ -202,6 +218,15 @@ void pl_shader_linearize(struct pl_shader *sh, enum pl_color_transfer trc)
     default:
         abort();
     }
+
+    sh_key_end(sh, true);
+
+    // Every curve involves one transcendental function per channel, except
+    // for PQ which needs two
+    sh_add_cost(sh, (struct pl_shader_cost) {
+        .transcendentals = trc == PL_COLOR_TRC_PQ ? 6 : 3,
+        .registers       = 1,
+    });
 }
 
 void pl_shader_delinearize(struct pl_shader *sh, enum pl_color_transfer trc)
@@ -212,6 +237,7 @@ void pl_shader_delinearize(struct pl_shader *sh, enum pl_color_transfer trc)
     if (trc == PL_COLOR_TRC_LINEAR)
         return;
 
+    sh_key_begin(sh, SH_KEY("delinearize", trc));
     GLSL("// pl_shader_delinearize         \n"
          "color.rgb = max(color.rgb, 0.0); \n");
 
@@ -275,6 +301,25 @@ void pl_shader_delinearize(struct pl_shader *sh, enum pl_color_transfer trc)
     default:
         abort();
     }
+
+    sh_key_end(sh, true);
+
+    bool twice = trc == PL_COLOR_TRC_PQ || trc == PL_COLOR_TRC_HLG;
+    sh_add_cost(sh, (struct pl_shader_cost) {
+        .transcendentals = twice ? 6 : 3,
+        .registers       = 1,
+    });
+}
+
+// Number of transcendental operations in the OOTF / inverse OOTF
+static int ootf_cost(enum pl_color_light light)
+{
+    switch (light) {
+    case PL_COLOR_LIGHT_SCENE_HLG:      return 1;
+    case PL_COLOR_LIGHT_SCENE_709_1886: return 6;
+    case PL_COLOR_LIGHT_SCENE_1_2:      return 3;
+    default:                            return 0;
+    }
 }
 
 // Applies the OOTF / inverse OOTF
@@ -314,6 +359,9 @@ static void pl_shader_ootf(struct pl_shader *sh, enum pl_color_light light,
     default:
         abort();
     }
+    sh_add_cost(sh, (struct pl_shader_cost) {
+        .transcendentals = ootf_cost(light),
+    });
 }
 
 static void pl_shader_inverse_ootf(struct pl_shader *sh,
@@ -346,6 +394,9 @@ static void pl_shader_inverse_ootf(struct pl_shader *sh,
     default:
         abort();
     }
+    sh_add_cost(sh, (struct pl_shader_cost) {
+        .transcendentals = ootf_cost(light),
+    });
 }
 
 const struct pl_color_map_params pl_color_map_default_params = {
@@ -355,25 +406,26 @@ const struct pl_color_map_params pl_color_map_default_params = {
     .peak_detect_frames      = 10,
 };
 
-static void hdr_update_peak(struct pl_shader *sh,
+// Returns false on failures not determined by the parameters, see sh_key_end
+static bool hdr_update_peak(struct pl_shader *sh,
                             const struct pl_color_map_params *params)
 {
     if (!params->peak_detect_state)
-        return;
+        return true;
 
     int frames = PL_DEF(params->peak_detect_frames, 10);
     if (frames < 1 || frames > 1000) {
         PL_ERR(sh, "Parameter peak_detect_frames must be >= 1 and <= 1000 "
                "(was %d).", frames);
-        return;
+        return true;
     }
 
     if (!sh_require_obj(sh, params->peak_detect_state, PL_SHADER_OBJ_PEAK_DETECT))
-        return;
+        return false;
 
     if (!sh_try_compute(sh, 8, 8, true, sizeof(uint32_t))) {
         PL_WARN(sh, "HDR peak detection requires compute shaders.. disabling");
-        return;
+        return true;
     }
 
     struct pl_shader_obj *obj = *params->peak_detect_state;
@@ -399,19 +451,20 @@ static void hdr_update_peak(struct pl_shader *sh,
     };
 
     struct ra_var_layout idx_l, num_l, ctr_l, max_l, sum_l, max_tl, sum_tl;
+    void *tmp = ta_arena_ctx(sh->tmp);
     bool ok = true;
-    ok &= ra_buf_desc_append(sh->tmp, ra, &ssbo, &idx_l, idx);
-    ok &= ra_buf_desc_append(sh->tmp, ra, &ssbo, &num_l, num);
-    ok &= ra_buf_desc_append(sh->tmp, ra, &ssbo, &ctr_l, ctr);
-    ok &= ra_buf_desc_append(sh->tmp, ra, &ssbo, &max_l, max);
-    ok &= ra_buf_desc_append(sh->tmp, ra, &ssbo, &sum_l, sum);
-    ok &= ra_buf_desc_append(sh->tmp, ra, &ssbo, &max_tl, max_total);
-    ok &= ra_buf_desc_append(sh->tmp, ra, &ssbo, &sum_tl, sum_total);
+    ok &= ra_buf_desc_append(tmp, ra, &ssbo, &idx_l, idx);
+    ok &= ra_buf_desc_append(tmp, ra, &ssbo, &num_l, num);
+    ok &= ra_buf_desc_append(tmp, ra, &ssbo, &ctr_l, ctr);
+    ok &= ra_buf_desc_append(tmp, ra, &ssbo, &max_l, max);
+    ok &= ra_buf_desc_append(tmp, ra, &ssbo, &sum_l, sum);
+    ok &= ra_buf_desc_append(tmp, ra, &ssbo, &max_tl, max_total);
+    ok &= ra_buf_desc_append(tmp, ra, &ssbo, &sum_tl, sum_total);
 
     if (!ok) {
         PL_WARN(sh, "HDR peak detection exhausts device limits.. disabling");
         talloc_free(ssbo.buffer_vars);
-        return;
+        return true;
     }
 
     // Create the SSBO if necessary
@@ -431,7 +484,7 @@ static void hdr_update_peak(struct pl_shader *sh,
 
     if (!obj->buf) {
         PL_ERR(sh, "Failed creating peak detection SSBO!");
-        return;
+        return false;
     }
 
     // Attach the SSBO and perform the peak detection logic
@@ -496,70 +549,80 @@ static void hdr_update_peak(struct pl_shader *sh,
          sum_total.name, sum.name, idx.name, sum.name,
          max.name, sum.name, idx.name,
          num.name, num.name, frames + 1);
+
+    return true;
 }
 
 // Average light level for SDR signals. This is equal to a signal level of 0.5
 // under a typical presentation gamma of about 2.0.
 static const float sdr_avg = 0.25;
 
-static void pl_shader_tone_map(struct pl_shader *sh, struct pl_color_space src,
+// Returns the result of hdr_update_peak
+static bool pl_shader_tone_map(struct pl_shader *sh, struct pl_color_space src,
                                struct pl_color_space dst, ident_t luma,
                                const struct pl_color_map_params *params)
 {
     // no-op if no tone mapping necessary
     if (src.sig_peak <= dst.sig_peak)
-        return;
+        return true;
 
     GLSL("// pl_shader_tone_map\n");
 
     // To prevent discoloration due to out-of-bounds clipping, we need to make
     // sure to reduce the value range as far as necessary to keep the entire
     // signal in range, so tone map based on the brightest component.
+    ident_t src_peak = sh_const_float(sh, "src_peak", src.sig_peak);
+    ident_t src_avg = sh_const_float(sh, "src_avg", src.sig_avg);
     GLSL("float sig = max(max(color.r, color.g), color.b); \n"
-         "float sig_peak = %f;                             \n"
-         "float sig_avg = %f;                              \n",
-         src.sig_peak, src.sig_avg);
+         "float sig_peak = %s;                             \n"
+         "float sig_avg = %s;                              \n",
+         src_peak, src_avg);
 
     // HDR peak detection is done before scaling based on the dst.sig_peak/avg
     // in order to make the detected values stable / averageable.
-    hdr_update_peak(sh, params);
+    bool ok = hdr_update_peak(sh, params);
 
     // Rescale the variables in order to bring it into a representation where
     // 1.0 represents the dst_peak. This is because all of the tone mapping
     // algorithms are defined in such a way that they map to the range [0.0, 1.0].
     if (dst.sig_peak > 1.0) {
-        GLSL("sig *= 1.0/%f;      \n"
-             "sig_peak *= 1.0/%f; \n",
-             dst.sig_peak, dst.sig_peak);
+        ident_t dst_peak = sh_const_float(sh, "dst_peak", dst.sig_peak);
+        GLSL("sig *= 1.0/%s;      \n"
+             "sig_peak *= 1.0/%s; \n",
+             dst_peak, dst_peak);
     }
 
     // Desaturate the color using a coefficient dependent on the signal level
     if (params->tone_mapping_desaturate > 0) {
         GLSL("float luma = dot(%s, color.rgb);                      \n"
              "float coeff = max(sig - 0.18, 1e-6) / max(sig, 1e-6); \n"
-             "coeff = pow(coeff, %f);                               \n"
+             "coeff = pow(coeff, %s);                               \n"
              "color.rgb = mix(color.rgb, vec3(luma), coeff);        \n"
              "sig = mix(sig, luma, coeff);                          \n",
-             luma, 10.0 / params->tone_mapping_desaturate);
+             luma, sh_const_float(sh, "desat_exp",
+                                  10.0 / params->tone_mapping_desaturate));
+        sh_add_cost(sh, (struct pl_shader_cost) { .transcendentals = 1 });
     }
 
     // Store the original signal level for later re-use
     GLSL("float sig_orig = sig;\n");
 
     // Scale the signal to compensate for differences in the average brightness
-    GLSL("float slope = min(1.0, %f / sig_avg); \n"
+    GLSL("float slope = min(1.0, %s / sig_avg); \n"
          "sig *= slope;                         \n"
          "sig_peak *= slope;                    \n",
-         dst.sig_avg);
+         sh_const_float(sh, "dst_avg", dst.sig_avg));
 
+    // The tone mapping parameter is a specialization constant, so only the
+    // algorithm itself determines the generated text
     float param = params->tone_mapping_param;
     switch (params->tone_mapping_algo) {
     case PL_TONE_MAPPING_CLIP:
-        GLSL("sig *= %f;\n", PL_DEF(param, 1.0));
+        GLSL("sig *= %s;\n", sh_const_float(sh, "param", PL_DEF(param, 1.0)));
         break;
 
     case PL_TONE_MAPPING_MOBIUS:
-        GLSL("const float j = %f;                                           \n"
+        GLSL("float j = %s;                                                 \n"
              // solve for M(j) = j; M(sig_peak) = 1.0; M'(j) = 1.0
              // where M(x) = scale * (x+a)/(x+b)
              "float a = -j*j * (sig_peak - 1.0) / (j*j - 2.0*j + sig_peak); \n"
@@ -567,14 +630,14 @@ static void pl_shader_tone_map(struct pl_shader *sh, struct pl_color_space src,
              "          max(1e-6, sig_peak - 1.0);                          \n"
              "float scale = (b*b + 2.0*b*j + j*j) / (b-a);                  \n"
              "sig = sig > j ? (scale * (sig + a) / (sig + b)) : sig;        \n",
-             PL_DEF(param, 0.3));
+             sh_const_float(sh, "param", PL_DEF(param, 0.3)));
         break;
 
     case PL_TONE_MAPPING_REINHARD: {
-        float contrast = PL_DEF(param, 0.5),
-              offset = (1.0 - contrast) / contrast;
-        GLSL("sig = sig / (sig + %f);                   \n"
-             "float scale = (sig_peak + %f) / sig_peak; \n"
+        float contrast = PL_DEF(param, 0.5);
+        ident_t offset = sh_const_float(sh, "param", (1.0 - contrast) / contrast);
+        GLSL("sig = sig / (sig + %s);                   \n"
+             "float scale = (sig_peak + %s) / sig_peak; \n"
              "sig *= scale;                             \n",
              offset, offset);
         break;
@@ -592,14 +655,17 @@ static void pl_shader_tone_map(struct pl_shader *sh, struct pl_color_space src,
     }
 
     case PL_TONE_MAPPING_GAMMA:
-        GLSL("const float cutoff = 0.05, gamma = 1.0/%f;                     \n"
+        GLSL("const float cutoff = 0.05;                                     \n"
+             "float gamma = 1.0/%s;                                          \n"
              "float scale = pow(cutoff / sig_peak, gamma) / cutoff;          \n"
              "sig = sig > cutoff ? pow(sig / sig_peak, gamma) : scale * sig; \n",
-             PL_DEF(param, 1.8));
+             sh_const_float(sh, "param", PL_DEF(param, 1.8)));
+        sh_add_cost(sh, (struct pl_shader_cost) { .transcendentals = 2 });
         break;
 
     case PL_TONE_MAPPING_LINEAR:
-        GLSL("sig *= %f / sig_peak;\n", PL_DEF(param, 1.0));
+        GLSL("sig *= %s / sig_peak;\n",
+             sh_const_float(sh, "param", PL_DEF(param, 1.0)));
         break;
 
     default:
@@ -610,6 +676,8 @@ static void pl_shader_tone_map(struct pl_shader *sh, struct pl_color_space src,
     // linearly to the RGB channels. (this prevents discoloration)
     GLSL("sig = min(sig, 1.0);        \n"
         "color.rgb *= sig / sig_orig; \n");
+    sh_add_cost(sh, (struct pl_shader_cost) { .registers = 2 });
+    return ok;
 }
 
 void pl_shader_color_map(struct pl_shader *sh,
@@ -620,8 +688,6 @@ void pl_shader_color_map(struct pl_shader *sh,
     if (!sh_require(sh, PL_SHADER_SIG_COLOR, 0, 0))
         return;
 
-    GLSL("// pl_shader_color_map\n");
-    GLSL("{\n");
     params = PL_DEF(params, &pl_color_map_default_params);
 
     // If the source light type is unknown, infer it from the transfer function.
@@ -684,6 +750,34 @@ void pl_shader_color_map(struct pl_shader *sh,
                        src.sig_avg != dst.sig_avg ||
                        src.light != dst.light;
 
+    // Adapting the primaries can reduce the gamut, so figure out by how much
+    struct pl_matrix3x3 cms_mat;
+    if (src.primaries != dst.primaries) {
+        const struct pl_raw_primaries *csp_src, *csp_dst;
+        csp_src = pl_raw_primaries_get(src.primaries),
+        csp_dst = pl_raw_primaries_get(dst.primaries);
+        cms_mat = pl_get_color_mapping_matrix(csp_src, csp_dst, params->intent);
+        for (int c = 0; c < 3; c++)
+            src.sig_peak = fmaxf(src.sig_peak, cms_mat.m[c][c]);
+    }
+
+    // The signal levels themselves are constants, so only the branches they
+    // select determine the generated text
+    sh_key_begin(sh, SH_KEY("color_map", params->intent,
+                            params->tone_mapping_algo,
+                            params->tone_mapping_desaturate > 0,
+                            params->gamut_warning,
+                            params->peak_detect_state != NULL,
+                            params->peak_detect_frames,
+                            src.primaries, src.transfer, src.light,
+                            dst.primaries, dst.transfer, dst.light,
+                            prelinearized, need_linear,
+                            src.sig_peak > dst.sig_peak,
+                            dst.sig_peak > 1.0));
+
+    GLSL("// pl_shader_color_map\n");
+    GLSL("{\n");
+
     // Various operations need access to the src_luma and dst_luma respectively,
     // so just always make them available if we're doing anything at all
     ident_t src_luma = NULL, dst_luma = NULL;
@@ -712,22 +806,14 @@ void pl_shader_color_map(struct pl_shader *sh,
 
     // Adapt to the right colorspace (primaries) if necessary
     if (src.primaries != dst.primaries) {
-        const struct pl_raw_primaries *csp_src, *csp_dst;
-        csp_src = pl_raw_primaries_get(src.primaries),
-        csp_dst = pl_raw_primaries_get(dst.primaries);
-        struct pl_matrix3x3 cms_mat;
-        cms_mat = pl_get_color_mapping_matrix(csp_src, csp_dst, params->intent);
         GLSL("color.rgb = %s * color.rgb;\n", sh_var(sh, (struct pl_shader_var) {
             .var = ra_var_mat3("cms_matrix"),
             .data = PL_TRANSPOSE_3X3(cms_mat.m),
         }));
-        // Since this can reduce the gamut, figure out by how much
-        for (int c = 0; c < 3; c++)
-            src.sig_peak = fmaxf(src.sig_peak, cms_mat.m[c][c]);
     }
 
     // Tone map to rescale the signal average/peak.
-    pl_shader_tone_map(sh, src, dst, dst_luma, params);
+    bool ok = pl_shader_tone_map(sh, src, dst, dst_luma, params);
 
     // Warn for remaining out-of-gamut colors is enabled
     if (params->gamut_warning) {
@@ -743,4 +829,5 @@ void pl_shader_color_map(struct pl_shader *sh,
         pl_shader_delinearize(sh, dst.transfer);
 
     GLSL("}\n");
+    sh_key_end(sh, ok);
 }
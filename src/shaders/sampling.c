@@ -31,9 +31,6 @@ void pl_shader_deband(struct pl_shader *sh, const struct ra_tex *ra_tex,
     if (!sh_require(sh, PL_SHADER_SIG_NONE, ra_tex->params.w, ra_tex->params.h))
         return;
 
-    GLSL("vec4 color;\n");
-    GLSL("// pl_shader_deband\n");
-    GLSL("{\n");
     params = PL_DEF(params, &pl_deband_default_params);
 
     ident_t tex, pos, pt;
@@ -41,6 +38,13 @@ void pl_shader_deband(struct pl_shader *sh, const struct ra_tex *ra_tex,
     if (!tex)
         return;
 
+    // The remaining parameters are specialization constants, so only the
+    // structure of the shader needs to be part of the key
+    sh_key_begin(sh, SH_KEY("deband", params->iterations, params->grain > 0));
+
+    GLSL("vec4 color;\n");
+    GLSL("// pl_shader_deband\n");
+    GLSL("{\n");
     GLSL("vec2 pos = %s;\n", pos);
 
     // Initialize the PRNG. This is friendly for wide usage and returns in
@@ -89,21 +93,32 @@ void pl_shader_deband(struct pl_shader *sh, const struct ra_tex *ra_tex,
 
     // For each iteration, compute the average at a given distance and
     // pick it instead of the color if the difference is below the threshold.
+    ident_t radius = sh_const_float(sh, "radius", params->radius);
+    ident_t threshold = sh_const_float(sh, "threshold", params->threshold / 1000);
     for (int i = 1; i <= params->iterations; i++) {
-        GLSL("avg = %s(pos, %f, prng);                              \n"
-             "diff = abs(color - avg);                              \n"
-             "color = mix(avg, color, greaterThan(diff, vec4(%f))); \n",
-             average, i * params->radius, params->threshold / (1000 * i));
+        GLSL("avg = %s(pos, %d.0 * %s, prng);                            \n"
+             "diff = abs(color - avg);                                   \n"
+             "color = mix(avg, color, greaterThan(diff, vec4(%s / %d.0))); \n",
+             average, i, radius, threshold, i);
     }
 
     // Add some random noise to smooth out residual differences
     if (params->grain > 0) {
+        ident_t grain = sh_const_float(sh, "grain", params->grain / 1000.0);
         GLSL("vec3 noise = vec3(%s(prng), %s(prng), %s(prng)); \n"
-             "color.rgb += %f * (noise - vec3(0.5));           \n",
-             random, random, random, params->grain / 1000.0);
+             "color.rgb += %s * (noise - vec3(0.5));           \n",
+             random, random, random, grain);
     }
 
     GLSL("}\n");
+    sh_key_end(sh, true);
+
+    // Every iteration samples four texels at a random angle (sin + cos)
+    sh_add_cost(sh, (struct pl_shader_cost) {
+        .tex_fetches     = 1 + 4 * params->iterations,
+        .transcendentals = 2 * params->iterations,
+        .registers       = 4,
+    });
 }
 
 // Helper function to compute the src/dst sizes and upscaling ratios
@@ -143,15 +158,43 @@ static bool setup_src(struct pl_shader *sh, const struct pl_sample_src *src,
     return true;
 }
 
+// Whether every output pixel corresponds to exactly one source texel, at the
+// same position
+static bool is_pointwise(const struct pl_sample_src *src)
+{
+    const struct ra_tex_params *tpars = &src->tex->params;
+    float src_w = PL_DEF(pl_rect_w(src->rect), tpars->w);
+    float src_h = PL_DEF(pl_rect_h(src->rect), tpars->h);
+    return src->rect.x0 == 0 && src->rect.y0 == 0 &&
+           src_w == tpars->w && src_h == tpars->h &&
+           PL_DEF(src->new_w, src_w) == src_w &&
+           PL_DEF(src->new_h, src_h) == src_h;
+}
+
 bool pl_shader_sample_direct(struct pl_shader *sh, const struct pl_sample_src *src)
 {
     ident_t tex, pos;
     if (!setup_src(sh, src, &tex, &pos, NULL, NULL, NULL, NULL, NULL))
         return false;
 
-    GLSL("// pl_shader_sample_direct    \n"
-         "vec4 color = texture(%s, %s); \n",
-         tex, pos);
+    ident_t fused = NULL;
+    if (is_pointwise(src))
+        fused = sh_fuse_point(sh, src->tex, tex, pos);
+
+    sh_key_begin(sh, SH_KEY("sample_direct", !!fused));
+    GLSL("// pl_shader_sample_direct \n");
+    if (fused) {
+        GLSL("vec4 color = %s();\n", fused);
+    } else {
+        GLSL("vec4 color = texture(%s, %s);\n", tex, pos);
+    }
+    sh_key_end(sh, true);
+
+    // If fused, the cost is accounted for by sh_fuse_resolve instead
+    sh_add_cost(sh, (struct pl_shader_cost) {
+        .tex_fetches = fused ? 0 : 1,
+        .registers   = 1,
+    });
     return true;
 }
 
@@ -191,6 +234,7 @@ bool pl_shader_sample_bicubic(struct pl_shader *sh, const struct pl_sample_src *
                 "will most likely result in nasty aliasing");
     }
 
+    sh_key_begin(sh, SH_KEY("sample_bicubic", 0));
     GLSL("// pl_shader_sample_bicubic                   \n"
          "vec4 color = vec4(0.0);                       \n"
          "{                                             \n"
@@ -218,22 +262,20 @@ bool pl_shader_sample_bicubic(struct pl_shader *sh, const struct pl_sample_src *
          "color = mix(aa, ab, parmx.b);                 \n"
          "}                                             \n",
          tex, tex, tex, tex);
+    sh_key_end(sh, true);
+
+    sh_add_cost(sh, (struct pl_shader_cost) {
+        .tex_fetches = 4,
+        .registers   = 6,
+    });
     return true;
 }
 
-static bool filter_compat(const struct pl_filter *filter, float inv_scale,
-                          int lut_entries,
-                          const struct pl_sample_polar_params *params)
-{
-    if (!filter)
-        return false;
-    if (filter->params.lut_entries != lut_entries)
-        return false;
-    if (fabs(filter->params.filter_scale - inv_scale) > 1e-3)
-        return false;
-
-    return pl_filter_config_eq(&filter->params.config, &params->filter);
-}
+// Names of the constants describing the filter radius
+struct polar_radius {
+    ident_t radius;
+    ident_t cutoff;
+};
 
 // Subroutine for computing and adding an individual texel contribution
 // If planar is false, samples directly
@@ -241,7 +283,8 @@ static bool filter_compat(const struct pl_filter *filter, float inv_scale,
 // `idx` must be defined by the caller
 static void polar_sample(struct pl_shader *sh, const struct pl_filter *filter,
                          ident_t tex, ident_t lut, ident_t lut_pos,
-                         int x, int y, int comps, bool planar)
+                         struct polar_radius r, int x, int y, int comps,
+                         bool planar)
 {
     // Since we can't know the subpixel position in advance, assume a
     // worst case scenario
@@ -256,12 +299,12 @@ static void polar_sample(struct pl_shader *sh, const struct pl_filter *filter,
     // Check for samples that might be skippable
     bool maybe_skippable = dmax >= filter->radius_cutoff - M_SQRT2;
     if (maybe_skippable)
-        GLSL("if (d < %f) {\n", filter->radius_cutoff);
+        GLSL("if (d < %s) {\n", r.cutoff);
 
     // Get the weight for this pixel
-    GLSL("w = texture(%s, %s(d * 1.0/%f)).r; \n"
+    GLSL("w = texture(%s, %s(d * 1.0/%s)).r; \n"
          "wsum += w;                        \n",
-         lut, lut_pos, filter->radius);
+         lut, lut_pos, r.radius);
 
     if (planar) {
         for (int n = 0; n < comps; n++)
@@ -274,6 +317,13 @@ static void polar_sample(struct pl_shader *sh, const struct pl_filter *filter,
 
     if (maybe_skippable)
         GLSL("}\n");
+
+    // The weight lookup, plus the sample itself unless it's taken from shmem
+    // or a gather. The distance requires a square root
+    sh_add_cost(sh, (struct pl_shader_cost) {
+        .tex_fetches     = planar ? 1 : 2,
+        .transcendentals = 1,
+    });
 }
 
 bool pl_shader_sample_polar(struct pl_shader *sh, const struct pl_sample_src *src,
@@ -297,8 +347,13 @@ bool pl_shader_sample_polar(struct pl_shader *sh, const struct pl_sample_src *sr
     if (!sh_require_obj(sh, params->lut, PL_SHADER_OBJ_LUT))
         return false;
 
-    struct pl_shader_obj *lut = *params->lut;
-    int lut_entries = PL_DEF(params->lut_entries, 64);
+    struct pl_shader_obj *obj = *params->lut;
+    int lut_entries = params->lut_entries;
+    if (!lut_entries) {
+        lut_entries = params->max_error > 0
+                        ? PL_MIN(ra->limits.max_tex_1d_dim, 1024)
+                        : 64;
+    }
     float inv_scale = 1.0 / PL_MIN(ratio_x, ratio_y);
     inv_scale = PL_MAX(inv_scale, 1.0);
 
@@ -308,55 +363,31 @@ bool pl_shader_sample_polar(struct pl_shader *sh, const struct pl_sample_src *sr
         return false;
     }
 
-    if (!lut->tex || !filter_compat(lut->filter, inv_scale, lut_entries, params))
-    {
-        const struct ra_fmt *fmt = ra_find_fmt(ra, RA_FMT_FLOAT, 1, 32, true,
-                                               RA_FMT_CAP_SAMPLEABLE |
-                                               RA_FMT_CAP_LINEAR);
-        if (!fmt) {
-            PL_WARN(sh, "Found no matching texture format for polar LUT");
-            return false;
-        }
-
-        PL_INFO(sh, "Recreating polar filter LUT");
-        pl_filter_free(&lut->filter);
-        lut->filter = pl_filter_generate(sh->ctx, &(struct pl_filter_params) {
-            .config         = params->filter,
-            .lut_entries    = lut_entries,
-            .filter_scale   = inv_scale,
-            .cutoff         = PL_DEF(params->cutoff, 0.001),
-        });
-
-        if (!lut->filter) {
-            // This should never happen, but just in case ..
-            PL_ERR(sh, "Failed initializing polar filter!");
-            return false;
-        }
+    bool ok = sh_lut_filter(sh, &obj->lut, &(struct pl_filter_params) {
+        .config         = params->filter,
+        .lut_entries    = lut_entries,
+        .max_error      = params->max_error,
+        .filter_scale   = inv_scale,
+        .approximate    = true,
+        .lut_type       = params->lut_type,
+        .cutoff         = PL_DEF(params->cutoff, 0.001),
+    });
 
-        lut->tex = ra_tex_create(ra, &(struct ra_tex_params) {
-            .w              = lut_entries,
-            .format         = fmt,
-            .sampleable     = true,
-            .sample_mode    = RA_TEX_SAMPLE_LINEAR,
-            .address_mode   = RA_TEX_ADDRESS_CLAMP,
-            .initial_data   = lut->filter->weights,
-        });
+    if (!ok)
+        return false;
 
-        if (!lut->tex) {
-            PL_ERR(sh, "Failed creating polar LUT texture!");
-            return false;
-        }
-    }
+    // The generated code only depends on the LUT geometry and the sizes
+    // determining the shmem layout, so everything before this is not covered
+    const struct pl_filter *filter = obj->lut->filter;
+    sh_key_begin(sh, SH_KEY("sample_polar", comps, ratio_x, ratio_y,
+                            filter->radius_cutoff));
 
-    assert(lut->filter && lut->tex);
-    ident_t lut_pos = sh_lut_pos(sh, lut_entries);
-    ident_t lut_tex = sh_desc(sh, (struct pl_shader_desc) {
-        .desc = {
-            .name = "polar_lut",
-            .type = RA_DESC_SAMPLED_TEX,
-        },
-        .object = lut->tex,
-    });
+    ident_t lut_pos = sh_lut_pos(sh, filter->params.lut_entries);
+    struct polar_radius r = {
+        .radius = sh_const_float(sh, "radius", filter->radius),
+        .cutoff = sh_const_float(sh, "radius_cutoff", filter->radius_cutoff),
+    };
+    ident_t lut_tex = sh_lut_desc(sh, obj->lut, "polar_lut");
 
     GLSL("// pl_shader_sample_polar                     \n"
          "vec4 color = vec4(0.0);                       \n"
@@ -369,7 +400,7 @@ bool pl_shader_sample_polar(struct pl_shader *sh, const struct pl_sample_src *sr
          "vec4 c;                                       \n",
          pos, size, pt);
 
-    int bound   = ceil(lut->filter->radius_cutoff);
+    int bound   = ceil(filter->radius_cutoff);
     int offset  = bound - 1; // padding top/left
     int padding = offset + bound; // total padding
 
@@ -411,19 +442,27 @@ bool pl_shader_sample_polar(struct pl_shader *sh, const struct pl_sample_src *sr
              "groupMemoryBarrier(); \n"
              "barrier();            \n");
 
+        // The texels are loaded cooperatively by all threads in the group
+        int threads = bw * bh;
+        sh_add_cost(sh, (struct pl_shader_cost) {
+            .tex_fetches = (iw * ih + threads - 1) / threads,
+            .registers   = 3,
+        });
+
         // Dispatch the actual samples
         for (int y = 1 - bound; y <= bound; y++) {
             for (int x = 1 - bound; x <= bound; x++) {
                 GLSL("idx = %d * rel.y + rel.x + %d;\n",
                      iw, iw * (y + offset) + x + offset);
-                polar_sample(sh, lut->filter, src_tex, lut_tex, lut_pos, x, y,
-                             comps, true);
+                polar_sample(sh, filter, src_tex, lut_tex, lut_pos, r,
+                             x, y, comps, true);
             }
         }
     } else {
         // Fragment shader sampling
         for (int n = 0; n < comps; n++)
             GLSL("vec4 in%d;\n", n);
+        sh_add_cost(sh, (struct pl_shader_cost) { .registers = 3 + comps });
 
         // Iterate over the LUT space in groups of 4 texels at a time, and
         // decide for each texel group whether to use gathering or direct
@@ -435,7 +474,7 @@ bool pl_shader_sample_polar(struct pl_shader *sh, const struct pl_sample_src *sr
                 // four gathered texels, without having to discard any. So
                 // only do it if we suspsect it will be a win rather than a
                 // loss.
-                bool use_gather = sqrt(x*x + y*y) < lut->filter->radius_cutoff;
+                bool use_gather = sqrt(x*x + y*y) < filter->radius_cutoff;
 
                 // Make sure all required features are supported
                 use_gather &= ra->glsl.version >= 400;
@@ -446,8 +485,8 @@ bool pl_shader_sample_polar(struct pl_shader *sh, const struct pl_sample_src *sr
                     // Switch to direct sampling instead
                     for (int yy = y; yy <= bound && yy <= y + 1; yy++) {
                         for (int xx = x; xx <= bound && xx <= x + 1; xx++) {
-                            polar_sample(sh, lut->filter, src_tex, lut_tex,
-                                         lut_pos, xx, yy, comps, false);
+                            polar_sample(sh, filter, src_tex, lut_tex,
+                                         lut_pos, r, xx, yy, comps, false);
                         }
                     }
                     continue; // next group of 4
@@ -458,6 +497,9 @@ bool pl_shader_sample_polar(struct pl_shader *sh, const struct pl_sample_src *sr
                     GLSL("in%d = textureGatherOffset(%s, base, "
                          "ivec2(%d, %d), %d);\n", n, src_tex, x, y, n);
                 }
+                sh_add_cost(sh, (struct pl_shader_cost) {
+                    .tex_gathers = comps,
+                });
 
                 // Mix in all of the points with their weights
                 for (int p = 0; p < 4; p++) {
@@ -469,8 +511,8 @@ bool pl_shader_sample_polar(struct pl_shader *sh, const struct pl_sample_src *sr
                         continue; // next subpixel
 
                     GLSL("idx = %d;\n", p);
-                    polar_sample(sh, lut->filter, src_tex, lut_tex, lut_pos,
-                                 x+xo[p], y+yo[p], comps, true);
+                    polar_sample(sh, filter, src_tex, lut_tex, lut_pos,
+                                 r, x+xo[p], y+yo[p], comps, true);
                 }
             }
         }
@@ -478,5 +520,6 @@ bool pl_shader_sample_polar(struct pl_shader *sh, const struct pl_sample_src *sr
 
     GLSL("color = color / vec4(wsum); \n"
          "}");
+    sh_key_end(sh, true);
     return true;
 }
@@ -0,0 +1,182 @@
+/*
+ * This file is part of libplacebo.
+ *
+ * libplacebo is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libplacebo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libplacebo. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Same as the alignment guaranteed by TA allocations
+#define ARENA_ALIGN 16
+#define ALIGN_UP(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// Size of the first chunk. Every further chunk is twice as large as the
+// previous one (or large enough to fit the allocation, if larger)
+#define MIN_CHUNK_SIZE 4096
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size; // usable size, always a multiple of ARENA_ALIGN
+    size_t used; // always a multiple of ARENA_ALIGN
+};
+
+#define CHUNK_HEADER ALIGN_UP(sizeof(struct arena_chunk))
+#define CHUNK_DATA(c) ((unsigned char *)(c) + CHUNK_HEADER)
+
+struct ta_arena {
+    // All chunks ever allocated, in order of use. Chunks are never freed,
+    // only rewound when the allocation reaches them again after a reset.
+    struct arena_chunk *first;
+    struct arena_chunk *cur;
+    void *ctx; // see ta_arena_ctx
+};
+
+/* Create a new, empty arena. No memory is allocated for the contents until
+ * the first allocation.
+ */
+struct ta_arena *ta_arena_new(void *ta_parent)
+{
+    return ta_xznew(ta_parent, struct ta_arena);
+}
+
+/* Release all allocations made from the arena, as well as all children of
+ * ta_arena_ctx(). The chunks backing the arena are retained for re-use.
+ */
+void ta_arena_reset(struct ta_arena *arena)
+{
+    // The other chunks get rewound lazily, when moving on to them
+    arena->cur = arena->first;
+    if (arena->cur)
+        arena->cur->used = 0;
+    if (arena->ctx)
+        ta_free_children(arena->ctx);
+}
+
+static void *alloc_slow(struct ta_arena *arena, size_t size)
+{
+    struct arena_chunk *prev = arena->cur;
+    struct arena_chunk *c = prev ? prev->next : arena->first;
+
+    // Re-use the next chunk if it's large enough, otherwise insert a new one
+    // in front of it
+    if (!c || c->size < size) {
+        size_t chunk_size = prev ? prev->size * 2 : MIN_CHUNK_SIZE;
+        if (chunk_size < size)
+            chunk_size = size;
+
+        struct arena_chunk *new = ta_xalloc_size(arena, CHUNK_HEADER + chunk_size);
+        *new = (struct arena_chunk) {
+            .next = c,
+            .size = chunk_size,
+        };
+
+        if (prev) {
+            prev->next = new;
+        } else {
+            arena->first = new;
+        }
+        c = new;
+    }
+
+    c->used = size;
+    arena->cur = c;
+    return CHUNK_DATA(c);
+}
+
+/* Allocate `size` bytes from the arena. The memory is uninitialized, and
+ * remains valid until the next ta_arena_reset (or until the arena is freed).
+ */
+void *ta_arena_alloc(struct ta_arena *arena, size_t size)
+{
+    size = ALIGN_UP(size);
+    assert(size < ((size_t) -1) / 2);
+
+    struct arena_chunk *c = arena->cur;
+    if (c && c->size - c->used >= size) {
+        void *ptr = CHUNK_DATA(c) + c->used;
+        c->used += size;
+        return ptr;
+    }
+
+    return alloc_slow(arena, size);
+}
+
+void *ta_arena_zalloc(struct ta_arena *arena, size_t size)
+{
+    void *ptr = ta_arena_alloc(arena, size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void *ta_arena_memdup(struct ta_arena *arena, const void *ptr, size_t size)
+{
+    if (!ptr) {
+        assert(!size);
+        return NULL;
+    }
+
+    void *res = ta_arena_alloc(arena, size);
+    memcpy(res, ptr, size);
+    return res;
+}
+
+char *ta_arena_strdup(struct ta_arena *arena, const char *str)
+{
+    return str ? ta_arena_memdup(arena, str, strlen(str) + 1) : NULL;
+}
+
+char *ta_arena_vasprintf(struct ta_arena *arena, const char *fmt, va_list ap)
+{
+    // Try formatting the string into the remaining space of the current
+    // chunk directly, which avoids formatting it twice in the common case
+    struct arena_chunk *c = arena->cur;
+    size_t avail = c ? c->size - c->used : 0;
+    char *ptr = avail ? (char *) CHUNK_DATA(c) + c->used : NULL;
+
+    va_list copy;
+    va_copy(copy, ap);
+    int len = vsnprintf(ptr, avail, fmt, copy);
+    va_end(copy);
+    if (len < 0)
+        return ta_oom_s(NULL);
+
+    if ((size_t) len < avail) {
+        c->used += ALIGN_UP(len + 1);
+        return ptr;
+    }
+
+    char *str = ta_arena_alloc(arena, len + 1);
+    vsnprintf(str, len + 1, fmt, ap);
+    return str;
+}
+
+char *ta_arena_asprintf(struct ta_arena *arena, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    char *res = ta_arena_vasprintf(arena, fmt, ap);
+    va_end(ap);
+    return res;
+}
+
+void *ta_arena_ctx(struct ta_arena *arena)
+{
+    if (!arena->ctx)
+        arena->ctx = ta_xnew_context(arena);
+    return arena->ctx;
+}
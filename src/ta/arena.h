@@ -0,0 +1,49 @@
+/*
+ * This file is part of libplacebo.
+ *
+ * libplacebo is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libplacebo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libplacebo. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TA_ARENA_H_
+#define TA_ARENA_H_
+
+#include "ta.h"
+
+// A bump-pointer allocator for short-lived allocations which all get released
+// together. Allocations from an arena are not TA allocations: they can't be
+// freed, reallocated or used as a parent individually. Instead, the arena is
+// reset as a whole, which is O(1) and keeps the underlying memory around, so
+// that a steady state of allocate/reset cycles doesn't call malloc() at all.
+//
+// The arena itself is a TA allocation, and can be freed with ta_free (or by
+// freeing its parent). All of the functions abort on OOM, like the ta_x*
+// functions.
+struct ta_arena;
+
+struct ta_arena *ta_arena_new(void *ta_parent);
+void ta_arena_reset(struct ta_arena *arena);
+
+void *ta_arena_alloc(struct ta_arena *arena, size_t size);
+void *ta_arena_zalloc(struct ta_arena *arena, size_t size);
+void *ta_arena_memdup(struct ta_arena *arena, const void *ptr, size_t size);
+char *ta_arena_strdup(struct ta_arena *arena, const char *str);
+char *ta_arena_asprintf(struct ta_arena *arena, const char *fmt, ...) TA_PRF(2, 3);
+char *ta_arena_vasprintf(struct ta_arena *arena, const char *fmt, va_list ap) TA_PRF(2, 0);
+
+// Returns a regular TA context whose children get freed by ta_arena_reset.
+// This is meant for the rare allocations which need full TA semantics (e.g.
+// growing arrays), and which should still share the lifetime of the arena.
+void *ta_arena_ctx(struct ta_arena *arena);
+
+#endif
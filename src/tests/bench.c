@@ -0,0 +1,262 @@
+#include "tests.h"
+#include "ra.h"
+
+#include <time.h>
+#include <unistd.h>
+
+// Artificial delay added to pass creation, to simulate shader compilation.
+// This wraps the null RA's pass_create
+static int compile_delay_us;
+static const struct ra_fns *null_fns;
+static struct ra_fns slow_fns;
+
+static const struct ra_pass *slow_pass_create(const struct ra *ra,
+                                              const struct ra_pass_params *params)
+{
+    usleep(compile_delay_us);
+    return null_fns->pass_create(ra, params);
+}
+
+static const struct ra *slow_ra_create(const struct ra *ra)
+{
+    null_fns = ra->impl;
+    slow_fns = *ra->impl;
+    slow_fns.pass_create = slow_pass_create;
+
+    struct ra *slow = malloc(sizeof(*slow));
+    *slow = *ra;
+    slow->impl = &slow_fns;
+    return slow;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const struct ra_tex *create_tex(const struct ra *ra, int w, int h)
+{
+    const struct ra_fmt *fmt = ra_find_fmt(ra, RA_FMT_FLOAT, 4, 16, true,
+                                           RA_FMT_CAP_LINEAR |
+                                           RA_FMT_CAP_RENDERABLE);
+    REQUIRE(fmt);
+
+    return ra_tex_create(ra, &(struct ra_tex_params) {
+        .w           = w,
+        .h           = h,
+        .format      = fmt,
+        .sampleable  = true,
+        .renderable  = true,
+        .storable    = !!(fmt->caps & RA_FMT_CAP_STORABLE),
+        .sample_mode = RA_TEX_SAMPLE_LINEAR,
+    });
+}
+
+// Records a variant of a trivial shader. Each distinct `variant` results in
+// a distinct signature and therefore a distinct cached pass
+static void record_shader(struct pl_shader *sh, const struct ra_tex *src,
+                          int variant)
+{
+    pl_shader_deband(sh, src, &(struct pl_deband_params) {
+        .iterations = 1,
+        .radius     = 1.0 + variant,
+        .threshold  = 4.0,
+    });
+}
+
+// Dispatches `num_passes` passes per frame. The last `fresh` of them use a
+// new variant every frame, which forces that many compilations (and, once
+// the cache is full, evictions) per frame
+static void bench_dispatch(struct pl_context *ctx, const struct ra *ra,
+                           const struct pl_dispatch_params *params,
+                           int num_passes, int fresh, int rounds)
+{
+    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra, params);
+    const struct ra_tex *tex = create_tex(ra, 64, 64);
+
+    // Populate the cache
+    for (int i = 0; i < num_passes; i++) {
+        struct pl_shader *sh = pl_dispatch_begin(dp);
+        record_shader(sh, tex, i);
+        REQUIRE(pl_dispatch_finish(dp, sh, tex));
+    }
+
+    struct pl_dispatch_compile_stats stats;
+    pl_dispatch_compile_stats(dp, &stats);
+    int num_compiled = stats.num_compiled;
+
+    // The shader ident is part of the signature, so each variant has to be
+    // dispatched at the same position within the frame to hit the cache
+    double start = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        pl_dispatch_reset_frame(dp);
+        for (int i = 0; i < num_passes; i++) {
+            struct pl_shader *sh = pl_dispatch_begin(dp);
+            int variant = i;
+            if (i >= num_passes - fresh)
+                variant += (r + 1) * fresh;
+            record_shader(sh, tex, variant);
+            REQUIRE(pl_dispatch_finish(dp, sh, tex));
+        }
+    }
+
+    double per_dispatch = (now_ns() - start) / (rounds * num_passes);
+
+    // Apart from the fresh variants, every dispatch must be a cache hit
+    pl_dispatch_compile_stats(dp, &stats);
+    REQUIRE(stats.num_compiled == num_compiled + rounds * fresh);
+    if (params && params->max_passes)
+        REQUIRE(pl_dispatch_stats(dp, NULL, 0) <= params->max_passes);
+
+    printf("dispatch (%5d passes, %3d fresh, max %5d, keys %d): "
+           "%8.1f ns/dispatch\n", num_passes, fresh,
+           params ? params->max_passes : 0,
+           params ? params->structural_keys : 0, per_dispatch);
+
+    ra_tex_destroy(ra, &tex);
+    pl_dispatch_destroy(&dp);
+}
+
+// Measures how long the render thread stalls on compiling `num_passes` new
+// passes, using a trivial fallback shader while they're pending
+static void bench_compile(struct pl_context *ctx, const struct ra *ra,
+                          int threads, int num_passes)
+{
+    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra, &(struct pl_dispatch_params) {
+        .compile_threads = threads,
+    });
+
+    const struct ra_tex *tex = create_tex(ra, 64, 64);
+
+    // Make sure the fallback shader is already compiled
+    struct pl_shader *sh = pl_dispatch_begin(dp);
+    pl_shader_deband(sh, tex, NULL);
+    REQUIRE(pl_dispatch_finish(dp, sh, tex));
+
+    double start = now_ns();
+    for (int i = 0; i < num_passes; i++) {
+        pl_dispatch_reset_frame(dp);
+        struct pl_shader *fallback = pl_dispatch_begin(dp);
+        pl_shader_deband(fallback, tex, NULL);
+        sh = pl_dispatch_begin(dp);
+        record_shader(sh, tex, i + 1);
+        REQUIRE(pl_dispatch_finish_fallback(dp, sh, fallback, tex));
+    }
+    double elapsed = now_ns() - start;
+
+    struct pl_dispatch_compile_stats stats;
+    pl_dispatch_compile_stats(dp, &stats);
+    printf("compile  (%5d passes, %d threads): %8.1f us/dispatch, "
+           "%8.1f us stalled/pass\n", num_passes, threads,
+           elapsed / num_passes / 1e3, stats.stall_ns / num_passes / 1e3);
+
+    ra_tex_destroy(ra, &tex);
+    pl_dispatch_destroy(&dp);
+}
+
+// Representative pipelines, as they would be recorded once per frame
+struct pipeline_state {
+    const struct ra_tex *src;
+    struct pl_shader_obj *obj;
+};
+
+static void pipeline_deband(struct pl_shader *sh, struct pipeline_state *s)
+{
+    pl_shader_deband(sh, s->src, NULL);
+}
+
+static void pipeline_polar(struct pl_shader *sh, struct pipeline_state *s)
+{
+    // Upscale a 720p region to the full 1080p output
+    REQUIRE(pl_shader_sample_polar(sh, &(struct pl_sample_src) {
+        .tex   = s->src,
+        .rect  = {0, 0, 1280, 720},
+        .new_w = 1920,
+        .new_h = 1080,
+    }, &(struct pl_sample_polar_params) {
+        .filter = pl_filter_ewa_lanczos,
+        .lut    = &s->obj,
+    }));
+}
+
+static void pipeline_color_map(struct pl_shader *sh, struct pipeline_state *s)
+{
+    REQUIRE(pl_shader_sample_direct(sh, &(struct pl_sample_src) {
+        .tex = s->src,
+    }));
+
+    pl_shader_color_map(sh, &(struct pl_color_map_params) {
+        .peak_detect_state = &s->obj,
+    }, pl_color_space_hdr10, pl_color_space_bt709, false);
+}
+
+static void bench_pipeline(struct pl_context *ctx, const struct ra *ra,
+                           const char *name, int rounds,
+                           void (*record)(struct pl_shader *sh,
+                                          struct pipeline_state *s))
+{
+    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra, NULL);
+    struct pipeline_state state = { .src = create_tex(ra, 1920, 1080) };
+    const struct ra_tex *fbo = create_tex(ra, 1920, 1080);
+
+    // The first round compiles the pass, so exclude it from the measurement
+    double start = 0.0;
+    for (int r = 0; r <= rounds; r++) {
+        if (r == 1)
+            start = now_ns();
+        pl_dispatch_reset_frame(dp);
+        struct pl_shader *sh = pl_dispatch_begin(dp);
+        record(sh, &state);
+        REQUIRE(pl_dispatch_finish(dp, sh, fbo));
+    }
+
+    double per_dispatch = (now_ns() - start) / rounds;
+    printf("pipeline %-10s: %8.1f us/dispatch, %8.0f dispatches/s\n",
+           name, per_dispatch / 1e3, 1e9 / per_dispatch);
+
+    pl_shader_obj_destroy(&state.obj);
+    ra_tex_destroy(ra, &state.src);
+    ra_tex_destroy(ra, &fbo);
+    pl_dispatch_destroy(&dp);
+}
+
+int main()
+{
+    setbuf(stdout, NULL);
+    struct pl_context *ctx = pl_context_create(PL_API_VER, &(struct pl_context_params) {
+        .log_cb    = pl_log_simple,
+        .log_level = PL_LOG_WARN,
+    });
+
+    const struct ra *ra = ra_null_create(ctx, NULL);
+
+    bench_dispatch(ctx, ra, NULL, 16, 0, 1000);
+    bench_dispatch(ctx, ra, NULL, 256, 0, 64);
+    bench_dispatch(ctx, ra, NULL, 4096, 0, 4);
+
+    // Full cache with a few new passes per frame, forcing constant eviction
+    bench_dispatch(ctx, ra, &(struct pl_dispatch_params) {
+        .max_passes = 128,
+    }, 128, 8, 64);
+
+    // Skipping the shader text generation on cache hits
+    bench_dispatch(ctx, ra, &(struct pl_dispatch_params) {
+        .structural_keys = true,
+    }, 16, 0, 1000);
+
+    bench_pipeline(ctx, ra, "deband", 10000, pipeline_deband);
+    bench_pipeline(ctx, ra, "polar", 10000, pipeline_polar);
+    bench_pipeline(ctx, ra, "color_map", 10000, pipeline_color_map);
+
+    // Cold cache, with simulated compilation cost
+    const struct ra *slow = slow_ra_create(ra);
+    compile_delay_us = 500;
+    bench_compile(ctx, slow, 0, 64);
+    bench_compile(ctx, slow, 4, 64);
+    free((void *) slow);
+
+    ra_null_destroy(&ra);
+    pl_context_destroy(&ctx);
+}
@@ -0,0 +1,460 @@
+#include "tests.h"
+#include "shaders.h"
+
+#include <pthread.h>
+
+static void record_shader(struct pl_shader *sh, const struct ra_tex *src)
+{
+    pl_shader_deband(sh, src, NULL);
+    pl_shader_linearize(sh, PL_COLOR_TRC_GAMMA22);
+}
+
+static bool binds(const struct ra_null_cmd *cmd, const struct ra_tex *tex)
+{
+    for (int d = 0; d < cmd->pass->params.num_descriptors; d++) {
+        if (cmd->desc_bindings[d].object == tex)
+            return true;
+    }
+
+    return false;
+}
+
+static void cache_limit_tests(struct pl_context *ctx, const struct ra *ra,
+                              const struct ra_tex *src, const struct ra_tex *fbo)
+{
+    static const enum pl_color_transfer trcs[] = {
+        PL_COLOR_TRC_BT_1886, PL_COLOR_TRC_SRGB, PL_COLOR_TRC_PQ,
+        PL_COLOR_TRC_HLG, PL_COLOR_TRC_V_LOG, PL_COLOR_TRC_S_LOG1,
+    };
+
+    const int num = PL_ARRAY_SIZE(trcs);
+    struct pl_dispatch_params limits[2] = {{0}};
+    size_t empty_size = 0;
+
+    // Without limits, every shader should end up as a separate pass. For
+    // the limited runs, each frame dispatches one of these shaders in turn
+    for (int n = -1; n < PL_ARRAY_SIZE(limits); n++) {
+        struct pl_dispatch *dp = pl_dispatch_create(ctx, ra,
+                                        n < 0 ? NULL : &limits[n]);
+        if (n < 0)
+            empty_size = pl_dispatch_save(dp, NULL);
+
+        for (int frame = 0; frame < (n < 0 ? num : 3 * num); frame++) {
+            pl_dispatch_reset_frame(dp);
+            struct pl_shader *sh = pl_dispatch_begin(dp);
+            REQUIRE(pl_shader_sample_direct(sh, &(struct pl_sample_src) { .tex = src }));
+            pl_shader_linearize(sh, trcs[frame % num]);
+            REQUIRE(pl_dispatch_finish(dp, sh, fbo));
+            if (n < 0)
+                continue;
+
+            int num_passes = pl_dispatch_stats(dp, NULL, 0);
+            size_t size = pl_dispatch_save(dp, NULL) - empty_size;
+            REQUIRE(num_passes > 0 && num_passes < num);
+            if (limits[n].max_passes)
+                REQUIRE(num_passes <= limits[n].max_passes);
+            if (limits[n].max_cache_size)
+                REQUIRE(size <= limits[n].max_cache_size);
+        }
+
+        if (n < 0) {
+            REQUIRE(pl_dispatch_stats(dp, NULL, 0) == num);
+            limits[0].max_passes = 2;
+            // The estimated size of a pass exceeds the size of its saved
+            // program, so this can't hold all of the passes at once
+            limits[1].max_cache_size = pl_dispatch_save(dp, NULL) - empty_size;
+        }
+
+        pl_dispatch_destroy(&dp);
+    }
+
+    ra_null_clear_commands(ra);
+}
+
+static void precompile_tests(struct pl_context *ctx, const struct ra *ra,
+                             const struct ra_tex *src, const struct ra_tex *fbo)
+{
+    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra, NULL);
+    struct pl_shader *sh = pl_dispatch_begin(dp);
+    record_shader(sh, src);
+    REQUIRE(pl_dispatch_precompile(dp, sh, &fbo->params));
+
+    struct pl_dispatch_compile_stats stats;
+    pl_dispatch_compile_stats(dp, &stats);
+    REQUIRE(stats.num_compiled == 1);
+    REQUIRE(pl_dispatch_stats(dp, NULL, 0) == 1);
+
+    // Precompiling must not run anything
+    int num_cmds;
+    ra_null_commands(ra, &num_cmds);
+    REQUIRE(num_cmds == 0);
+
+    // Dispatching the same shader (with the same ident) must reuse the pass
+    for (int i = 0; i < 2; i++) {
+        pl_dispatch_reset_frame(dp);
+        sh = pl_dispatch_begin(dp);
+        record_shader(sh, src);
+        REQUIRE(pl_dispatch_finish(dp, sh, fbo));
+    }
+
+    const struct ra_null_cmd *cmds = ra_null_commands(ra, &num_cmds);
+    REQUIRE(num_cmds == 2);
+    REQUIRE(cmds[0].pass == cmds[1].pass);
+    REQUIRE(cmds[0].target == fbo);
+    pl_dispatch_compile_stats(dp, &stats);
+    REQUIRE(stats.num_compiled == 1);
+    REQUIRE(pl_dispatch_stats(dp, NULL, 0) == 1);
+
+    // Compute shaders can't be precompiled for non-storable targets
+    REQUIRE(!fbo->params.storable);
+    if (ra->caps & RA_CAP_COMPUTE) {
+        pl_dispatch_reset_frame(dp);
+        sh = pl_dispatch_begin(dp);
+        sh->is_compute = true;
+        sh->res.compute_group_size[0] = 8;
+        sh->res.compute_group_size[1] = 8;
+        record_shader(sh, src);
+        REQUIRE(!pl_dispatch_precompile(dp, sh, &fbo->params));
+        pl_dispatch_compile_stats(dp, &stats);
+        REQUIRE(stats.num_compiled == 1);
+    }
+
+    ra_null_clear_commands(ra);
+    pl_dispatch_destroy(&dp);
+}
+
+static void fusion_tests(struct pl_context *ctx, const struct ra *ra,
+                         const struct ra_tex *src, const struct ra_tex *mid,
+                         const struct ra_tex *fbo)
+{
+    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra, &(struct pl_dispatch_params) {
+        .fuse_passes = true,
+    });
+
+    int num_cmds;
+    const struct ra_null_cmd *cmds;
+    ra_null_clear_commands(ra);
+
+    // A pointwise sample of the previous pass's target should be fused
+    struct pl_shader *sh = pl_dispatch_begin(dp);
+    pl_shader_deband(sh, src, NULL);
+    REQUIRE(pl_dispatch_finish(dp, sh, mid));
+    ra_null_commands(ra, &num_cmds);
+    REQUIRE(num_cmds == 0);
+
+    sh = pl_dispatch_begin(dp);
+    REQUIRE(pl_shader_sample_direct(sh, &(struct pl_sample_src) { .tex = mid }));
+    pl_shader_linearize(sh, PL_COLOR_TRC_GAMMA22);
+    REQUIRE(pl_dispatch_finish(dp, sh, fbo));
+    REQUIRE(pl_dispatch_flush(dp));
+
+    cmds = ra_null_commands(ra, &num_cmds);
+    REQUIRE(num_cmds == 1);
+    REQUIRE(cmds[0].target == fbo);
+    REQUIRE(binds(&cmds[0], src) && !binds(&cmds[0], mid));
+    ra_null_clear_commands(ra);
+
+    // Sampling the target non-pointwise requires running the pass first
+    pl_dispatch_reset_frame(dp);
+    sh = pl_dispatch_begin(dp);
+    pl_shader_deband(sh, src, NULL);
+    REQUIRE(pl_dispatch_finish(dp, sh, mid));
+
+    sh = pl_dispatch_begin(dp);
+    pl_shader_deband(sh, mid, NULL);
+    REQUIRE(pl_dispatch_finish(dp, sh, fbo));
+    pl_dispatch_reset_frame(dp);
+
+    cmds = ra_null_commands(ra, &num_cmds);
+    REQUIRE(num_cmds == 2);
+    REQUIRE(cmds[0].target == mid && binds(&cmds[0], src));
+    REQUIRE(cmds[1].target == fbo && binds(&cmds[1], mid));
+    ra_null_clear_commands(ra);
+
+    pl_dispatch_destroy(&dp);
+}
+
+static void subpass_tests(struct pl_context *ctx, const struct ra *ra,
+                          const struct ra_tex *src, const struct ra_tex *fbo)
+{
+    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra, NULL);
+    ra_null_clear_commands(ra);
+
+    // Merge a sampling and a color-only shader into an empty shader
+    struct pl_shader *sh = pl_dispatch_begin(dp);
+    struct pl_shader *sub1 = pl_dispatch_begin(dp);
+    struct pl_shader *sub2 = pl_dispatch_begin(dp);
+    pl_shader_deband(sub1, src, NULL);
+    pl_shader_linearize(sub2, PL_COLOR_TRC_GAMMA22);
+    REQUIRE(pl_shader_subpass(sh, sub1));
+    REQUIRE(pl_shader_subpass(sh, sub2));
+    REQUIRE(!pl_shader_subpass(sh, sub1)); // already has an output color
+    REQUIRE(!pl_shader_subpass(sh, sh));
+    pl_dispatch_abort(dp, sub1);
+    pl_dispatch_abort(dp, sub2);
+
+    int w, h;
+    REQUIRE(pl_shader_output_size(sh, &w, &h));
+    REQUIRE(w == src->params.w && h == src->params.h);
+
+    // The cost of the merged shader is the sum of its parts
+    struct pl_shader_cost cost = pl_shader_get_cost(sh);
+    REQUIRE(cost.tex_fetches == 1 + 4 * pl_deband_default_params.iterations);
+    REQUIRE(cost.transcendentals == 2 * pl_deband_default_params.iterations + 3);
+    REQUIRE(cost.registers > 0 && !cost.shmem);
+    REQUIRE(pl_dispatch_finish(dp, sh, fbo));
+
+    int num_cmds;
+    const struct ra_null_cmd *cmds = ra_null_commands(ra, &num_cmds);
+    REQUIRE(num_cmds == 1);
+    REQUIRE(binds(&cmds[0], src));
+    ra_null_clear_commands(ra);
+
+    pl_dispatch_destroy(&dp);
+}
+
+static void constant_tests(struct pl_context *ctx, const struct ra *ra,
+                           const struct ra_tex *src, const struct ra_tex *fbo)
+{
+    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra, NULL);
+    ra_null_clear_commands(ra);
+
+    // Changing a parameter that's a specialization constant should create a
+    // new pass, but with exactly the same shader text
+    for (int i = 0; i < 2; i++) {
+        pl_dispatch_reset_frame(dp);
+        struct pl_shader *sh = pl_dispatch_begin(dp);
+        pl_shader_deband(sh, src, &(struct pl_deband_params) {
+            .iterations = 1,
+            .threshold  = 4.0 + i,
+        });
+        REQUIRE(pl_dispatch_finish(dp, sh, fbo));
+    }
+
+    int num_cmds;
+    const struct ra_null_cmd *cmds = ra_null_commands(ra, &num_cmds);
+    REQUIRE(num_cmds == 2);
+    const struct ra_pass_params *p0 = &cmds[0].pass->params,
+                                *p1 = &cmds[1].pass->params;
+    REQUIRE(cmds[0].pass != cmds[1].pass);
+    REQUIRE(strcmp(p0->glsl_shader, p1->glsl_shader) == 0);
+    REQUIRE(p0->num_constants && p0->num_constants == p1->num_constants);
+    REQUIRE(memcmp(p0->constant_data, p1->constant_data,
+                   p0->num_constants * sizeof(float)) != 0);
+    ra_null_clear_commands(ra);
+    pl_dispatch_destroy(&dp);
+}
+
+static void finalize_tests(struct pl_context *ctx, const struct ra *ra,
+                           const struct ra_tex *src)
+{
+    // Shaders used without pl_dispatch get their text as a single string
+    struct pl_shader *sh = pl_shader_alloc(ctx, ra, 0);
+    record_shader(sh, src);
+    const struct pl_shader_res *res = pl_shader_finalize(sh);
+    REQUIRE(res && res->glsl && res->name);
+    REQUIRE(strstr(res->glsl, "// pl_shader_deband"));
+    REQUIRE(strstr(res->glsl, "// pl_shader_linearize"));
+    REQUIRE(strstr(res->glsl, res->name));
+
+    size_t len = strlen(res->glsl);
+    REQUIRE(len > 16 && strcmp(res->glsl + len - 16, "return color;\n}\n") == 0);
+    pl_shader_free(&sh);
+}
+
+#define NUM_THREADS 4
+
+struct thread_job {
+    struct pl_context *ctx;
+    const struct ra *ra;
+    const struct ra_tex *src;
+    struct pl_shader_obj *lut;
+    struct pl_shader *sh;
+    int index;
+};
+
+static void *build_shader(void *priv)
+{
+    struct thread_job *job = priv;
+    struct pl_shader *sh = pl_shader_alloc(job->ctx, job->ra, job->index);
+    REQUIRE(pl_shader_sample_polar(sh, &(struct pl_sample_src) {
+        .tex   = job->src,
+        .new_w = 96 + job->index,
+        .new_h = 96,
+    }, &(struct pl_sample_polar_params) {
+        .filter   = pl_filter_ewa_lanczos,
+        .lut_type = PL_FILTER_LUT_HALF,
+        .lut      = &job->lut,
+    }));
+    pl_shader_linearize(sh, PL_COLOR_TRC_GAMMA22);
+    job->sh = sh;
+    return NULL;
+}
+
+static void thread_tests(struct pl_context *ctx, const struct ra *ra,
+                         const struct ra_tex *src)
+{
+    const struct ra_tex *fbo[NUM_THREADS];
+    struct thread_job jobs[NUM_THREADS];
+    pthread_t threads[NUM_THREADS];
+
+    // Build the shaders concurrently, but dispatch them from this thread
+    for (int i = 0; i < NUM_THREADS; i++) {
+        fbo[i] = ra_tex_create(ra, &(struct ra_tex_params) {
+            .w          = 96 + i,
+            .h          = 96,
+            .format     = src->params.format,
+            .renderable = true,
+            .storable   = true,
+        });
+        REQUIRE(fbo[i]);
+
+        jobs[i] = (struct thread_job) {
+            .ctx = ctx, .ra = ra, .src = src, .index = i,
+        };
+        REQUIRE(pthread_create(&threads[i], NULL, build_shader, &jobs[i]) == 0);
+    }
+
+    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra, NULL);
+    ra_null_clear_commands(ra);
+    for (int i = 0; i < NUM_THREADS; i++) {
+        REQUIRE(pthread_join(threads[i], NULL) == 0);
+        REQUIRE(pl_dispatch_finish(dp, jobs[i].sh, fbo[i]));
+    }
+
+    // Every pass must have the source and the (realized) LUT texture bound.
+    // All of them upscale, so they should share the same cached LUT
+    int num_cmds;
+    const struct ra_null_cmd *cmds = ra_null_commands(ra, &num_cmds);
+    REQUIRE(num_cmds == NUM_THREADS);
+    const struct ra_tex *lut = NULL;
+    for (int i = 0; i < num_cmds; i++) {
+        REQUIRE(binds(&cmds[i], src));
+        bool found_lut = false;
+        for (int d = 0; d < cmds[i].pass->params.num_descriptors; d++) {
+            const struct ra_tex *tex = cmds[i].desc_bindings[d].object;
+            if (tex == src || tex == fbo[i] || tex->params.h)
+                continue;
+            REQUIRE(!lut || tex == lut);
+            lut = tex;
+            found_lut = true;
+        }
+        REQUIRE(found_lut);
+    }
+
+    // The polar LUT uses half floats, as requested
+    REQUIRE(lut->params.format->type == RA_FMT_FLOAT);
+    REQUIRE(lut->params.format->texel_size == 2);
+
+    ra_null_clear_commands(ra);
+    pl_dispatch_destroy(&dp);
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pl_shader_obj_destroy(&jobs[i].lut);
+        ra_tex_destroy(ra, &fbo[i]);
+    }
+}
+
+int main()
+{
+    struct pl_context *ctx = pl_test_context();
+    const struct ra *ra = ra_null_create(ctx, &(struct ra_null_params) {
+        .caps            = ra_null_default_params.caps,
+        .glsl            = ra_null_default_params.glsl,
+        .record_commands = true,
+    });
+    REQUIRE(ra);
+
+    const struct ra_fmt *fmt = ra_find_fmt(ra, RA_FMT_FLOAT, 4, 16, true,
+                                           RA_FMT_CAP_LINEAR |
+                                           RA_FMT_CAP_RENDERABLE);
+    REQUIRE(fmt);
+
+    const struct ra_tex *src = ra_tex_create(ra, &(struct ra_tex_params) {
+        .w           = 64,
+        .h           = 64,
+        .format      = fmt,
+        .sampleable  = true,
+        .sample_mode = RA_TEX_SAMPLE_LINEAR,
+    });
+
+    const struct ra_tex *fbo = ra_tex_create(ra, &(struct ra_tex_params) {
+        .w           = 64,
+        .h           = 64,
+        .format      = fmt,
+        .renderable  = true,
+    });
+    const struct ra_tex *mid = ra_tex_create(ra, &(struct ra_tex_params) {
+        .w           = 64,
+        .h           = 64,
+        .format      = fmt,
+        .sampleable  = true,
+        .renderable  = true,
+    });
+    REQUIRE(src && fbo && mid);
+
+    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra, NULL);
+    for (int i = 0; i < 5; i++) {
+        pl_dispatch_reset_frame(dp);
+        struct pl_shader *sh = pl_dispatch_begin(dp);
+        record_shader(sh, src);
+        REQUIRE(pl_dispatch_finish(dp, sh, fbo));
+    }
+
+    // Every dispatch should have been recorded, using the same cached pass
+    int num_cmds;
+    const struct ra_null_cmd *cmds = ra_null_commands(ra, &num_cmds);
+    REQUIRE(num_cmds == 5);
+    for (int i = 0; i < num_cmds; i++) {
+        REQUIRE(cmds[i].pass == cmds[0].pass);
+        REQUIRE(cmds[i].target == fbo);
+        REQUIRE(cmds[i].vertex_count == 4);
+        REQUIRE(!cmds[i].pass->params.push_constants_size ||
+                cmds[i].push_constants);
+
+        // The source texture must be bound to one of the descriptors
+        bool found = false;
+        for (int d = 0; d < cmds[i].pass->params.num_descriptors; d++)
+            found |= cmds[i].desc_bindings[d].object == src;
+        REQUIRE(found);
+    }
+
+    ra_null_clear_commands(ra);
+    ra_null_commands(ra, &num_cmds);
+    REQUIRE(num_cmds == 0);
+
+    struct pl_dispatch_compile_stats stats;
+    pl_dispatch_compile_stats(dp, &stats);
+    REQUIRE(stats.num_compiled == 1);
+
+    struct pl_dispatch_pass_stats pstats;
+    REQUIRE(pl_dispatch_stats(dp, &pstats, 1) == 1);
+    REQUIRE(pstats.cpu.count == 5);
+    REQUIRE(pstats.gpu.count == 0);
+
+    // The null RA provides cached programs, so this should round-trip
+    size_t cache_size = pl_dispatch_save(dp, NULL);
+    REQUIRE(cache_size);
+    uint8_t *cache = malloc(cache_size);
+    REQUIRE(pl_dispatch_save(dp, cache) == cache_size);
+
+    struct pl_dispatch *dp2 = pl_dispatch_create(ctx, ra, NULL);
+    REQUIRE(pl_dispatch_load(dp2, cache, cache_size));
+    REQUIRE(pl_dispatch_save(dp2, NULL) == cache_size);
+    pl_dispatch_destroy(&dp2);
+    free(cache);
+
+    pl_dispatch_destroy(&dp);
+    cache_limit_tests(ctx, ra, src, fbo);
+    precompile_tests(ctx, ra, src, fbo);
+    fusion_tests(ctx, ra, src, mid, fbo);
+    subpass_tests(ctx, ra, src, fbo);
+    constant_tests(ctx, ra, src, fbo);
+    finalize_tests(ctx, ra, src);
+    thread_tests(ctx, ra, src);
+
+    ra_tex_destroy(ra, &src);
+    ra_tex_destroy(ra, &mid);
+    ra_tex_destroy(ra, &fbo);
+    ra_null_destroy(&ra);
+    pl_context_destroy(&ctx);
+}
@@ -1,5 +1,199 @@
 #include "tests.h"
 
+// Compares a generated filter against direct (scalar) evaluation
+static void check_weights(const struct pl_filter *flt)
+{
+    const struct pl_filter_params *params = &flt->params;
+    const struct pl_filter_config *conf = &params->config;
+    int entries = params->lut_entries;
+
+    if (conf->polar) {
+        for (int i = 0; i < entries; i++) {
+            double x = conf->kernel->radius * i / (entries - 1);
+            REQUIRE(feq(flt->weights[i], pl_filter_sample(conf, x)));
+        }
+        return;
+    }
+
+    float scale = conf->kernel->radius / flt->radius;
+    for (int i = 0; i < entries; i++) {
+        double offset = i / (double)(entries - 1), sum = 0.0;
+        double ref[256];
+        REQUIRE(flt->row_size <= 256);
+        for (int n = 0; n < flt->row_size; n++) {
+            double x = (offset - (n - flt->row_size / 2.0 + 1)) * scale;
+            ref[n] = pl_filter_sample(conf, x);
+            sum += ref[n];
+        }
+        for (int n = 0; n < flt->row_size; n++) {
+            float w = flt->weights[i * flt->row_stride + n];
+            REQUIRE(fabs(w - ref[n] / sum) < 1e-6);
+        }
+    }
+}
+
+// Returns the maximum difference between the LUTs generated with and
+// without `approximate`
+static double approx_error(struct pl_context *ctx, struct pl_filter_params params)
+{
+    params.approximate = false;
+    const struct pl_filter *exact = pl_filter_generate(ctx, &params);
+    params.approximate = true;
+    const struct pl_filter *approx = pl_filter_generate(ctx, &params);
+    REQUIRE(exact && approx);
+    REQUIRE(exact->row_size == approx->row_size);
+
+    int size = params.lut_entries * PL_DEF(exact->row_stride, 1);
+    double max = 0.0;
+    for (int i = 0; i < size; i++)
+        max = fmax(max, fabs(exact->weights[i] - approx->weights[i]));
+
+    pl_filter_free(&exact);
+    pl_filter_free(&approx);
+    return max;
+}
+
+static void approx_tests(struct pl_context *ctx)
+{
+    struct pl_filter_function jinc = pl_filter_function_jinc;
+    jinc.radius = 12.0;
+    struct pl_filter_function kaiser = pl_filter_function_kaiser;
+    kaiser.params[0] = 8.0;
+
+    const struct pl_filter_config configs[] = {
+        pl_filter_ewa_lanczos,
+        { .kernel = &jinc, .polar = true },
+        { .kernel = &pl_filter_function_sinc, .window = &kaiser },
+    };
+
+    // The approximations must be accurate to well below float precision
+    for (int i = 0; i < PL_ARRAY_SIZE(configs); i++) {
+        double err = approx_error(ctx, (struct pl_filter_params) {
+            .config      = configs[i],
+            .lut_entries = 1024,
+        });
+        printf("approximation error: %g\n", err);
+        REQUIRE(err < 1e-7);
+    }
+}
+
+static void lut_type_tests(struct pl_context *ctx)
+{
+    struct pl_filter_params params = {
+        .config           = pl_filter_lanczos,
+        .lut_entries      = 64,
+        .filter_scale     = 1.7,
+        .row_stride_align = 3,
+        .pack_rgba        = true,
+    };
+
+    const struct pl_filter *ref = pl_filter_generate(ctx, &params);
+    REQUIRE(ref);
+    REQUIRE(ref->lut == ref->weights);
+    REQUIRE(ref->row_stride % 12 == 0);
+    int num = params.lut_entries * ref->row_stride;
+    REQUIRE(ref->lut_size == num * sizeof(float));
+
+    // Half floats: correctly rounded to 11 significant bits
+    params.lut_type = PL_FILTER_LUT_HALF;
+    const struct pl_filter *half = pl_filter_generate(ctx, &params);
+    REQUIRE(half);
+    REQUIRE(half->lut_size == num * sizeof(uint16_t));
+    for (int i = 0; i < num; i++) {
+        float err = fabs(half->weights[i] - ref->weights[i]);
+        REQUIRE(err <= fmax(fabs(ref->weights[i]) * 0x1p-11, 0x1p-25));
+    }
+
+    // Fixed point: the quantized rows must still add up to exactly 1.0
+    params.lut_type = PL_FILTER_LUT_SNORM16;
+    const struct pl_filter *snorm = pl_filter_generate(ctx, &params);
+    REQUIRE(snorm);
+    REQUIRE(snorm->lut_size == num * sizeof(int16_t));
+    const int16_t *lut = snorm->lut;
+    for (int i = 0; i < params.lut_entries; i++) {
+        int sum = 0;
+        for (int n = 0; n < snorm->row_stride; n++) {
+            int idx = i * snorm->row_stride + n;
+            REQUIRE(fabs(snorm->weights[idx] - ref->weights[idx]) < 2.0 / 32767);
+            sum += lut[idx];
+        }
+        REQUIRE(sum == 32767);
+    }
+
+    pl_filter_free(&ref);
+    pl_filter_free(&half);
+    pl_filter_free(&snorm);
+}
+
+// Returns the LUT size picked for the given error bound
+static int auto_size(struct pl_context *ctx, struct pl_filter_config config,
+                     float max_error)
+{
+    struct pl_filter_params params = {
+        .config    = config,
+        .max_error = max_error,
+    };
+
+    const struct pl_filter *flt = pl_filter_generate(ctx, &params);
+    REQUIRE(flt);
+    int entries = flt->params.lut_entries;
+    printf("max_error %g: %d entries, error %g\n", max_error, entries,
+           flt->lut_error);
+    REQUIRE(entries >= 2 && entries < 1024);
+    REQUIRE(flt->lut_error > 0 && flt->lut_error <= max_error);
+    pl_filter_free(&flt);
+
+    // One entry less must not be sufficient
+    params.lut_entries = entries - 1;
+    flt = pl_filter_generate(ctx, &params);
+    REQUIRE(flt);
+    REQUIRE(flt->params.lut_entries == entries - 1);
+    REQUIRE(flt->lut_error > max_error);
+    pl_filter_free(&flt);
+    return entries;
+}
+
+static void auto_size_tests(struct pl_context *ctx)
+{
+    // Smooth filters need fewer entries than sharp ones
+    REQUIRE(auto_size(ctx, pl_filter_gaussian, 1e-4) <
+            auto_size(ctx, pl_filter_lanczos, 1e-4));
+    REQUIRE(auto_size(ctx, pl_filter_ewa_robidoux, 1e-4) <
+            auto_size(ctx, pl_filter_ewa_lanczos, 1e-4));
+
+    // Tighter bounds need more entries
+    REQUIRE(auto_size(ctx, pl_filter_mitchell, 1e-3) <
+            auto_size(ctx, pl_filter_mitchell, 1e-5));
+}
+
+static void thread_tests(struct pl_context *ctx)
+{
+    struct pl_context *tctx = pl_context_create(PL_API_VER, &(struct pl_context_params) {
+        .log_cb         = pl_log_simple,
+        .log_level      = PL_LOG_WARN,
+        .filter_threads = 3,
+    });
+    REQUIRE(tctx);
+
+    // Large enough to actually get split up between the threads
+    struct pl_filter_params params = {
+        .config       = pl_filter_lanczos,
+        .lut_entries  = 4095,
+        .filter_scale = 8.0,
+    };
+
+    const struct pl_filter *serial = pl_filter_generate(ctx, &params);
+    const struct pl_filter *threaded = pl_filter_generate(tctx, &params);
+    REQUIRE(serial && threaded);
+    REQUIRE(serial->row_stride == threaded->row_stride);
+    size_t size = params.lut_entries * serial->row_stride * sizeof(float);
+    REQUIRE(memcmp(serial->weights, threaded->weights, size) == 0);
+
+    pl_filter_free(&serial);
+    pl_filter_free(&threaded);
+    pl_context_destroy(&tctx);
+}
+
 int main()
 {
     struct pl_context *ctx = pl_test_context();
@@ -41,7 +235,36 @@ int main()
             }
         }
 
+        check_weights(flt);
+        pl_filter_free(&flt);
+
+        // Also check a downscaling filter, which has larger rows
+        params.filter_scale = 2.5;
+        flt = pl_filter_generate(ctx, &params);
+        REQUIRE(flt);
+        check_weights(flt);
         pl_filter_free(&flt);
     }
+
+    // With blur > 1, the window gets evaluated beyond its radius for samples
+    // which are still inside the kernel. None of the named filters do this
+    struct pl_filter_function sinc = pl_filter_function_sinc;
+    sinc.radius = 1.3;
+    const struct pl_filter *flt = pl_filter_generate(ctx, &(struct pl_filter_params) {
+        .config = {
+            .kernel = &sinc,
+            .window = &pl_filter_function_hann,
+            .blur   = 1.2,
+        },
+        .lut_entries = 64,
+    });
+    REQUIRE(flt);
+    check_weights(flt);
+    pl_filter_free(&flt);
+
+    approx_tests(ctx);
+    lut_type_tests(ctx);
+    auto_size_tests(ctx);
+    thread_tests(ctx);
     pl_context_destroy(&ctx);
 }
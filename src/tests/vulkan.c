@@ -1,6 +1,28 @@
 #include "ra_tests.h"
 #include "shaders.h"
 
+static struct pl_shader *dispatch_shader(const struct ra *ra,
+                                        struct pl_dispatch *dp,
+                                        const struct ra_tex *src)
+{
+    struct pl_shader *sh = pl_dispatch_begin(dp);
+
+    // For testing, force the use of CS if possible
+    if (ra->caps & RA_CAP_COMPUTE) {
+        sh->is_compute = true;
+        sh->res.compute_group_size[0] = 8;
+        sh->res.compute_group_size[1] = 8;
+    }
+
+    pl_shader_deband(sh, src, &(struct pl_deband_params) {
+        .iterations     = 0,
+        .grain          = 0.0,
+    });
+
+    pl_shader_linearize(sh, PL_COLOR_TRC_GAMMA22);
+    return sh;
+}
+
 static void shader_tests(struct pl_context *ctx, const struct ra *ra)
 {
     const char *vert_shader =
@@ -108,7 +130,7 @@ static void shader_tests(struct pl_context *ctx, const struct ra *ra)
     ra_tex_clear(ra, fbo, (float[4]){0});
 
     // Test the use of pl_dispatch
-    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra);
+    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra, NULL);
 
     const struct ra_tex *src;
     src = ra_tex_create(ra, &(struct ra_tex_params) {
@@ -119,27 +141,30 @@ static void shader_tests(struct pl_context *ctx, const struct ra *ra)
         .initial_data   = data,
     });
 
+    // Pre-compile the pass, which should then get re-used below
+    REQUIRE(pl_dispatch_precompile(dp, dispatch_shader(ra, dp, src), &fbo->params));
+
     // Repeat this a few times to test the caching
     for (int i = 0; i < 10; i++) {
         printf("iteration %d\n", i);
         pl_dispatch_reset_frame(dp);
-        struct pl_shader *sh = pl_dispatch_begin(dp);
+        REQUIRE(pl_dispatch_finish(dp, dispatch_shader(ra, dp, src), fbo));
+    }
 
-        // For testing, force the use of CS if possible
-        if (ra->caps & RA_CAP_COMPUTE) {
-            sh->is_compute = true;
-            sh->res.compute_group_size[0] = 8;
-            sh->res.compute_group_size[1] = 8;
-        }
+    struct pl_dispatch_compile_stats stats;
+    pl_dispatch_compile_stats(dp, &stats);
+    REQUIRE(stats.num_compiled == 1);
 
-        pl_shader_deband(sh, src, &(struct pl_deband_params) {
-            .iterations     = 0,
-            .grain          = 0.0,
-        });
+    // Test that the pass cache survives a save/load round trip
+    size_t cache_size = pl_dispatch_save(dp, NULL);
+    uint8_t *cache = malloc(cache_size);
+    REQUIRE(pl_dispatch_save(dp, cache) == cache_size);
 
-        pl_shader_linearize(sh, PL_COLOR_TRC_GAMMA22);
-        REQUIRE(pl_dispatch_finish(dp, sh, fbo));
-    }
+    struct pl_dispatch *dp2 = pl_dispatch_create(ctx, ra, NULL);
+    REQUIRE(pl_dispatch_load(dp2, cache, cache_size));
+    REQUIRE(pl_dispatch_save(dp2, NULL) == cache_size);
+    pl_dispatch_destroy(&dp2);
+    free(cache);
 
     ra_tex_download(ra, &(struct ra_tex_transfer_params) {
         .tex = fbo,
@@ -157,6 +182,15 @@ static void shader_tests(struct pl_context *ctx, const struct ra *ra)
         }
     }
 
+    struct pl_dispatch_pass_stats pstats;
+    REQUIRE(pl_dispatch_stats(dp, &pstats, 1) == 1);
+    REQUIRE(pstats.cpu.count == 10);
+    REQUIRE(pstats.cpu.peak >= pstats.cpu.average);
+    REQUIRE(pstats.gpu.count <= 10);
+    printf("pass stats: cpu %d runs, avg %.1f us; gpu %d runs, avg %.1f us\n",
+           pstats.cpu.count, pstats.cpu.average / 1e3, pstats.gpu.count,
+           pstats.gpu.average / 1e3);
+
     pl_dispatch_destroy(&dp);
     ra_tex_destroy(ra, &src);
     ra_tex_destroy(ra, &fbo);
@@ -202,7 +236,7 @@ static void scaler_tests(struct pl_context *ctx, const struct ra *ra)
         .host_readable  = true,
     });
 
-    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra);
+    struct pl_dispatch *dp = pl_dispatch_create(ctx, ra, NULL);
     if (!dot5x5 || !fbo || !dp)
         goto error;
 
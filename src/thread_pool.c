@@ -0,0 +1,115 @@
+/*
+ * This file is part of libplacebo.
+ *
+ * libplacebo is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libplacebo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libplacebo. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <pthread.h>
+
+#include "thread_pool.h"
+
+struct job {
+    void (*fn)(void *priv);
+    void *priv;
+};
+
+struct pl_thread_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    bool terminate;
+
+    pthread_t *threads;
+    int num_threads;
+
+    // queue of pending jobs, oldest first
+    struct job *jobs;
+    int num_jobs;
+};
+
+static void *worker_thread(void *arg)
+{
+    struct pl_thread_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->num_jobs && !pool->terminate)
+            pthread_cond_wait(&pool->wakeup, &pool->lock);
+
+        // Keep draining the queue even after termination was requested
+        if (!pool->num_jobs)
+            break;
+
+        struct job job = pool->jobs[0];
+        TARRAY_REMOVE_AT(pool->jobs, pool->num_jobs, 0);
+
+        pthread_mutex_unlock(&pool->lock);
+        job.fn(job.priv);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+struct pl_thread_pool *pl_thread_pool_create(void *tactx, int num_threads)
+{
+    struct pl_thread_pool *pool = talloc_zero(tactx, struct pl_thread_pool);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+
+    pool->threads = talloc_array(pool, pthread_t, num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_t *thread = &pool->threads[pool->num_threads];
+        if (pthread_create(thread, NULL, worker_thread, pool) == 0)
+            pool->num_threads++;
+    }
+
+    if (!pool->num_threads)
+        pl_thread_pool_destroy(&pool);
+
+    return pool;
+}
+
+void pl_thread_pool_destroy(struct pl_thread_pool **ptr)
+{
+    struct pl_thread_pool *pool = *ptr;
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->terminate = true;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    assert(!pool->num_jobs);
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_mutex_destroy(&pool->lock);
+    talloc_free(pool);
+    *ptr = NULL;
+}
+
+void pl_thread_pool_push(struct pl_thread_pool *pool, void (*fn)(void *priv),
+                         void *priv)
+{
+    pthread_mutex_lock(&pool->lock);
+    assert(!pool->terminate);
+    TARRAY_APPEND(pool, pool->jobs, pool->num_jobs, (struct job) {
+        .fn   = fn,
+        .priv = priv,
+    });
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+}
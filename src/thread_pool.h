@@ -0,0 +1,35 @@
+/*
+ * This file is part of libplacebo.
+ *
+ * libplacebo is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libplacebo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libplacebo. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "common.h"
+
+// Simple fixed-size pool of worker threads, executing jobs in FIFO order
+struct pl_thread_pool;
+
+// Creates a pool with `num_threads` worker threads, allocated as a child of
+// `tactx`. Returns NULL if no thread could be started at all.
+struct pl_thread_pool *pl_thread_pool_create(void *tactx, int num_threads);
+
+// Blocks until all queued jobs have completed, then joins all threads and
+// frees the pool.
+void pl_thread_pool_destroy(struct pl_thread_pool **pool);
+
+// Queues `fn(priv)` for execution on one of the worker threads. The job may
+// run at any time after this call, and must do its own synchronization.
+void pl_thread_pool_push(struct pl_thread_pool *pool, void (*fn)(void *priv),
+                         void *priv);
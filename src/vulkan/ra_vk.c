@@ -38,6 +38,10 @@ struct ra_vk {
     // The "currently recording" command. This will be queued and replaced by
     // a new command every time we need to "switch" between queue families.
     struct vk_cmd *cmd;
+
+    // Nesting depth of ra_batch_begin. While nonzero, render passes are
+    // recorded into the same command instead of being submitted one by one.
+    int batch_depth;
 };
 
 struct vk_ctx *ra_vk_get(const struct ra *ra)
@@ -198,6 +202,7 @@ const struct ra *ra_create_vk(struct vk_ctx *vk)
         goto error;
 
     ra->glsl = p->spirv->glsl;
+    ra->caps = RA_CAP_SPEC_CONSTANTS;
     ra->limits = (struct ra_limits) {
         .max_tex_1d_dim    = vk->limits.maxImageDimension1D,
         .max_tex_2d_dim    = vk->limits.maxImageDimension2D,
@@ -1247,7 +1252,8 @@ static const struct ra_pass *vk_pass_create(const struct ra *ra,
 
 #define NUM_DS (PL_ARRAY_SIZE(pass_vk->dss))
 
-    static int dsSize[RA_DESC_TYPE_COUNT] = {0};
+    // Must not be static, since this may run on several threads at once
+    int dsSize[RA_DESC_TYPE_COUNT] = {0};
     VkDescriptorSetLayoutBinding *bindings =
         talloc_array(tmp, VkDescriptorSetLayoutBinding, num_desc);
 
@@ -1362,6 +1368,33 @@ static const struct ra_pass *vk_pass_create(const struct ra *ra,
         .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
     };
 
+    // The specialization constants only ever appear in the main shader, i.e.
+    // the fragment or compute shader
+    VkSpecializationInfo *specInfo = NULL;
+    if (params->num_constants) {
+        VkSpecializationMapEntry *entries = talloc_array(tmp,
+                VkSpecializationMapEntry, params->num_constants);
+
+        size_t data_size = 0;
+        for (int i = 0; i < params->num_constants; i++) {
+            const struct ra_constant *sc = &params->constants[i];
+            entries[i] = (VkSpecializationMapEntry) {
+                .constantID = sc->id,
+                .offset = sc->offset,
+                .size = ra_var_type_size(sc->type),
+            };
+            data_size = PL_MAX(data_size, sc->offset + entries[i].size);
+        }
+
+        specInfo = talloc_ptrtype(tmp, specInfo);
+        *specInfo = (VkSpecializationInfo) {
+            .mapEntryCount = params->num_constants,
+            .pMapEntries = entries,
+            .dataSize = data_size,
+            .pData = params->constant_data,
+        };
+    }
+
     switch (params->type) {
     case RA_PASS_RASTER: {
         sinfo.pCode = (uint32_t *) vert.start;
@@ -1458,6 +1491,7 @@ static const struct ra_pass *vk_pass_create(const struct ra *ra,
                     .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
                     .module = frag_shader,
                     .pName = "main",
+                    .pSpecializationInfo = specInfo,
                 }
             },
             .pVertexInputState = &(VkPipelineVertexInputStateCreateInfo) {
@@ -1535,6 +1569,7 @@ static const struct ra_pass *vk_pass_create(const struct ra *ra,
                 .stage = VK_SHADER_STAGE_COMPUTE_BIT,
                 .module = comp_shader,
                 .pName = "main",
+                .pSpecializationInfo = specInfo,
             },
             .layout = pass_vk->pipeLayout,
         };
@@ -1705,9 +1740,122 @@ static void set_ds(struct ra_pass_vk *pass_vk, uintptr_t dsbit)
     pass_vk->dmask |= dsbit;
 }
 
+// Number of measurements a single timer can have in flight at the same time.
+// Each measurement uses a pair of timestamp queries
+#define VK_TIMER_QUERIES 4
+
+// For ra_timer
+struct ra_timer {
+    VkQueryPool qpool;
+    int index_write; // next measurement slot to record
+    int index_read;  // oldest measurement slot with a pending result
+    int num_pending; // number of slots that were recorded but not yet queried
+    bool ready[VK_TIMER_QUERIES]; // set once the recording command completed
+    int valid_bits[VK_TIMER_QUERIES]; // timestampValidBits of the recording queue
+};
+
+static void vk_timer_destroy(const struct ra *ra, struct ra_timer *timer)
+{
+    struct vk_ctx *vk = ra_vk_get(ra);
+
+    vkDestroyQueryPool(vk->dev, timer->qpool, VK_ALLOC);
+    talloc_free(timer);
+}
+
+MAKE_LAZY_DESTRUCTOR(vk_timer_destroy, struct ra_timer);
+
+static struct ra_timer *vk_timer_create(const struct ra *ra)
+{
+    struct vk_ctx *vk = ra_vk_get(ra);
+    if (!vk->limits.timestampComputeAndGraphics)
+        return NULL;
+
+    struct ra_timer *timer = talloc_zero(NULL, struct ra_timer);
+
+    VkQueryPoolCreateInfo qinfo = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = VK_TIMER_QUERIES * 2,
+    };
+
+    VK(vkCreateQueryPool(vk->dev, &qinfo, VK_ALLOC, &timer->qpool));
+    return timer;
+
+error:
+    vk_timer_destroy(ra, timer);
+    return NULL;
+}
+
+static uint64_t vk_timer_query(const struct ra *ra, struct ra_timer *timer)
+{
+    struct vk_ctx *vk = ra_vk_get(ra);
+    int idx = timer->index_read;
+    if (!timer->num_pending || !timer->ready[idx])
+        return 0;
+
+    timer->index_read = (idx + 1) % VK_TIMER_QUERIES;
+    timer->num_pending--;
+
+    uint64_t ts[2];
+    VK(vkGetQueryPoolResults(vk->dev, timer->qpool, idx * 2, 2, sizeof(ts),
+                             ts, sizeof(ts[0]), VK_QUERY_RESULT_64_BIT));
+
+    // Only the lower `valid_bits` bits of the timestamps are meaningful, so
+    // mask the difference to handle the counter wrapping around
+    uint64_t diff = ts[1] - ts[0];
+    if (timer->valid_bits[idx] < 64)
+        diff &= (1ULL << timer->valid_bits[idx]) - 1;
+
+    return diff * vk->limits.timestampPeriod;
+
+error:
+    return 0;
+}
+
+static void vk_timer_done(struct ra_timer *timer, uintptr_t idx)
+{
+    timer->ready[idx] = true;
+}
+
+// Starts a new measurement in `cmd`. Returns the slot index, or -1 if the
+// measurement was skipped
+static int vk_timer_begin(const struct ra *ra, struct vk_cmd *cmd,
+                          struct ra_timer *timer)
+{
+    if (!timer || !cmd->pool->props.timestampValidBits)
+        return -1;
+
+    // Skip the measurement if all slots are still waiting to be queried
+    if (timer->num_pending == VK_TIMER_QUERIES)
+        return -1;
+
+    int idx = timer->index_write;
+    timer->index_write = (idx + 1) % VK_TIMER_QUERIES;
+    timer->num_pending++;
+    timer->ready[idx] = false;
+    timer->valid_bits[idx] = cmd->pool->props.timestampValidBits;
+
+    vkCmdResetQueryPool(cmd->buf, timer->qpool, idx * 2, 2);
+    vkCmdWriteTimestamp(cmd->buf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        timer->qpool, idx * 2);
+    return idx;
+}
+
+static void vk_timer_end(const struct ra *ra, struct vk_cmd *cmd,
+                         struct ra_timer *timer, int idx)
+{
+    if (idx < 0)
+        return;
+
+    vkCmdWriteTimestamp(cmd->buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        timer->qpool, idx * 2 + 1);
+    vk_cmd_callback(cmd, (vk_cb) vk_timer_done, timer, (void *)(uintptr_t) idx);
+}
+
 static void vk_pass_run(const struct ra *ra,
                         const struct ra_pass_run_params *params)
 {
+    struct ra_vk *p = ra->priv;
     struct vk_ctx *vk = ra_vk_get(ra);
     const struct ra_pass *pass = params->pass;
     struct ra_pass_vk *pass_vk = pass->priv;
@@ -1733,6 +1881,7 @@ static void vk_pass_run(const struct ra *ra,
         [RA_PASS_COMPUTE] = VK_PIPELINE_BIND_POINT_COMPUTE,
     };
 
+    int timer_idx = vk_timer_begin(ra, cmd, params->timer);
     vkCmdBindPipeline(cmd->buf, bindPoint[pass->params.type], pass_vk->pipe);
 
     VkDescriptorSet ds = NULL;
@@ -1781,6 +1930,7 @@ static void vk_pass_run(const struct ra *ra,
         const struct ra_buf *buf = ra_buf_pool_get(ra, &pass_vk->vbo, &vparams);
         if (!buf) {
             PL_ERR(ra, "Failed allocating vertex buffer!");
+            vk_timer_end(ra, cmd, params->timer, timer_idx);
             goto error;
         }
 
@@ -1840,9 +1990,12 @@ static void vk_pass_run(const struct ra *ra,
     for (int i = 0; i < pass->params.num_descriptors; i++)
         vk_release_descriptor(ra, cmd, pass, params->desc_bindings[i], i);
 
+    vk_timer_end(ra, cmd, params->timer, timer_idx);
+
     // flush the work so far into its own command buffer, for better
-    // intra-frame granularity
-    vk_submit(ra);
+    // intra-frame granularity, unless we're batching passes together
+    if (!p->batch_depth)
+        vk_submit(ra);
 
 error:
     return;
@@ -1855,6 +2008,20 @@ static void vk_flush(const struct ra *ra)
     vk_flush_commands(vk);
 }
 
+static void vk_batch_begin(const struct ra *ra)
+{
+    struct ra_vk *p = ra->priv;
+    p->batch_depth++;
+}
+
+static void vk_batch_end(const struct ra *ra)
+{
+    struct ra_vk *p = ra->priv;
+    assert(p->batch_depth > 0);
+    if (--p->batch_depth == 0)
+        vk_submit(ra);
+}
+
 struct vk_cmd *ra_vk_finish_frame(const struct ra *ra, const struct ra_tex *tex)
 {
     struct ra_vk *p = ra->priv;
@@ -1894,4 +2061,9 @@ static struct ra_fns ra_fns_vk = {
     .pass_destroy           = vk_pass_destroy_lazy,
     .pass_run               = vk_pass_run,
     .flush                  = vk_flush,
+    .batch_begin            = vk_batch_begin,
+    .batch_end              = vk_batch_end,
+    .timer_create           = vk_timer_create,
+    .timer_destroy          = vk_timer_destroy_lazy,
+    .timer_query            = vk_timer_query,
 };